@@ -0,0 +1,292 @@
+#include <arpa/inet.h>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <string>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <vector>
+
+#include "connector.hpp"
+#include "epoll.hpp"
+#include "forwarder.hpp"
+#include "listener.hpp"
+#include "replay_io.hpp"
+#include "socket_io.hpp"
+#include "tools.hpp"
+
+static size_t allocations = 0;
+
+void *operator new(size_t size) {
+    allocations += 1;
+    if (void *p = std::malloc(size ? size : 1)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void *operator new[](size_t size) {
+    return operator new(size);
+}
+
+void operator delete(void *p) noexcept {
+    std::free(p);
+}
+
+void operator delete[](void *p) noexcept {
+    std::free(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+    std::free(p);
+}
+
+void operator delete[](void *p, size_t) noexcept {
+    std::free(p);
+}
+
+#define MIN_TIME_NS 200000000
+#define SYNTHETIC_PACKETS 65536
+#define QUICK_PACKETS 4096
+#define MAX_EVENTS 32
+#define LOOPBACK_WINDOW 64
+#define LOOPBACK_STALL 100000
+
+// replays the trace until MIN_TIME_NS elapsed, the first pass creates the flows and is
+// not measured
+static bool run(const std::string &name, const Trace &trace) {
+    ReplayIo io(trace);
+    Forwarder forwarder(io, ReplayIo::LISTEN_FD, Tools::u64ToBe(0x0123456789abcdef));
+    io.replay(forwarder);
+
+    size_t packets = 0;
+    const size_t allocs_before = allocations;
+    const auto start = std::chrono::steady_clock::now();
+    std::chrono::nanoseconds elapsed;
+    do {
+        packets += io.replay(forwarder);
+        elapsed = std::chrono::steady_clock::now() - start;
+    } while (elapsed.count() < MIN_TIME_NS);
+    const size_t allocs = allocations - allocs_before;
+
+    std::printf(
+        "%-40s %10.1f ns %12.3f %12zu\n",
+        name.c_str(),
+        static_cast<double>(elapsed.count()) / packets,
+        static_cast<double>(allocs) / packets,
+        packets
+    );
+
+    if (io.errors()) {
+        std::fprintf(
+            stderr, "%s: %zu datagrams forwarded incorrectly\n", name.c_str(), io.errors()
+        );
+        return false;
+    }
+    return true;
+}
+
+// handles pending events the way the flprox event loop does
+static void pump(Epoll &epoll, Forwarder &forwarder, int *listen_fd, bool connected) {
+    struct epoll_event events[MAX_EVENTS];
+    const int num_events = epoll.wait(events, MAX_EVENTS, 0);
+    for (int i = 0; i < num_events; i++) {
+        const int sock = connected ? *static_cast<int *>(events[i].data.ptr) : events[i].data.fd;
+        if (sock == *listen_fd) {
+            forwarder.onListenReadable();
+        } else if (connected) {
+            forwarder.onFlowReadable(static_cast<Forwarder::FlowSide *>(events[i].data.ptr));
+        } else {
+            forwarder.onUpstreamReadable(sock);
+        }
+    }
+    forwarder.reap();
+}
+
+// sends back everything received on the destination socket
+static void echo(int sock) {
+    struct mmsghdr msgs[Forwarder::MAX_MSGS];
+    struct iovec iovecs[Forwarder::MAX_MSGS];
+    struct sockaddr_in6 addrs[Forwarder::MAX_MSGS];
+    static unsigned char buffers[Forwarder::MAX_MSGS][2048];
+    for (;;) {
+        ::memset(msgs, 0, sizeof(msgs));
+        for (int i = 0; i < Forwarder::MAX_MSGS; i++) {
+            iovecs[i] = {buffers[i], sizeof(buffers[i])};
+            msgs[i].msg_hdr.msg_name = &addrs[i];
+            msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+            msgs[i].msg_hdr.msg_iov = &iovecs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+        const int n = ::recvmmsg(sock, msgs, Forwarder::MAX_MSGS, MSG_DONTWAIT, NULL);
+        if (n <= 0) {
+            return;
+        }
+        for (int i = 0; i < n; i++) {
+            iovecs[i].iov_len = msgs[i].msg_len;
+        }
+        ::sendmmsg(sock, msgs, n, 0);
+    }
+}
+
+static int bindLoopback(struct sockaddr_in *addr) {
+    int sock = ::socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock < 0) {
+        throw std::system_error(errno, std::generic_category(), "socket");
+    }
+    ::memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(*addr);
+    if (::bind(sock, reinterpret_cast<struct sockaddr *>(addr), sizeof(*addr)) < 0 ||
+        ::getsockname(sock, reinterpret_cast<struct sockaddr *>(addr), &len) < 0) {
+        throw std::system_error(errno, std::generic_category(), "bind");
+    }
+    return sock;
+}
+
+// forwards through real loopback sockets: every flow is a client socket exchanging datagrams
+// with an echo socket through the forwarder, LOOPBACK_WINDOW datagrams in flight at once
+static bool runLoopback(bool connected, size_t flows, size_t size) {
+    const std::string name = std::string("loopback/") + (connected ? "connected" : "single") +
+                             "/flows:" + std::to_string(flows) + "/size:" + std::to_string(size);
+
+    struct sockaddr_in echo_addr;
+    const int echo_fd = bindLoopback(&echo_addr);
+    Connector cnctr("127.0.0.1", std::to_string(ntohs(echo_addr.sin_port)).c_str());
+
+    struct sockaddr_storage bind_addr;
+    int listen_fd = Listener::create("0", &bind_addr, connected);
+    const uint16_t listen_port = reinterpret_cast<struct sockaddr_in6 *>(&bind_addr)->sin6_port;
+
+    Epoll epoll;
+    if (connected) {
+        epoll.add(listen_fd, &listen_fd);
+    } else {
+        epoll.add(listen_fd);
+    }
+    SocketIo io(cnctr, epoll, bind_addr, false);
+    ForwarderOptions options;
+    options.connected = connected;
+    Forwarder forwarder(io, listen_fd, Tools::u64ToBe(0x0123456789abcdef), options);
+
+    Epoll client_epoll;
+    std::vector<int> clients(flows);
+    for (auto &client : clients) {
+        struct sockaddr_in addr;
+        client = bindLoopback(&addr);
+        addr.sin_port = listen_port;
+        if (::connect(client, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) < 0) {
+            throw std::system_error(errno, std::generic_category(), "connect");
+        }
+        client_epoll.add(client);
+    }
+
+    std::vector<unsigned char> payload(size, 0x5a);
+    unsigned char response[2048];
+    size_t packets = 0;
+    size_t lost = 0;
+    size_t next = 0;
+
+    // sends a window of datagrams and waits for all the echoes to come back
+    auto round = [&]() {
+        for (int i = 0; i < LOOPBACK_WINDOW; i++) {
+            ::send(clients[next], payload.data(), payload.size(), 0);
+            next = (next + 1) % clients.size();
+        }
+        int received = 0;
+        for (int idle = 0; received < LOOPBACK_WINDOW && idle < LOOPBACK_STALL; idle++) {
+            pump(epoll, forwarder, &listen_fd, connected);
+            echo(echo_fd);
+            pump(epoll, forwarder, &listen_fd, connected);
+
+            struct epoll_event events[MAX_EVENTS];
+            const int num_events = client_epoll.wait(events, MAX_EVENTS, 0);
+            for (int i = 0; i < num_events; i++) {
+                while (::recv(events[i].data.fd, response, sizeof(response), MSG_DONTWAIT) > 0) {
+                    received += 1;
+                    idle = 0;
+                }
+            }
+        }
+        lost += LOOPBACK_WINDOW - received;
+        return 2 * received; // a request and a response for every echo
+    };
+
+    for (size_t opened = 0; opened < clients.size(); opened += LOOPBACK_WINDOW) {
+        round();
+    }
+    lost = 0;
+
+    const size_t allocs_before = allocations;
+    const auto start = std::chrono::steady_clock::now();
+    std::chrono::nanoseconds elapsed;
+    do {
+        packets += round();
+        elapsed = std::chrono::steady_clock::now() - start;
+    } while (elapsed.count() < MIN_TIME_NS);
+    const size_t allocs = allocations - allocs_before;
+
+    std::printf(
+        "%-40s %10.1f ns %12.3f %12zu\n",
+        name.c_str(),
+        static_cast<double>(elapsed.count()) / packets,
+        static_cast<double>(allocs) / packets,
+        packets
+    );
+
+    forwarder.closeAll();
+    for (int client : clients) {
+        ::close(client);
+    }
+    ::close(listen_fd);
+    ::close(echo_fd);
+
+    if (lost) {
+        std::fprintf(stderr, "%s: %zu datagrams lost\n", name.c_str(), lost);
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char **argv) {
+    if (argc > 2) {
+        std::fprintf(stderr, "Usage: %s [-q | pcap_file]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    std::printf("%-40s %13s %12s %12s\n", "Benchmark", "Time/packet", "Allocs/packet", "Packets");
+
+    bool ok = true;
+    if (argc == 2 && std::string(argv[1]) == "-q") {
+        // a single short replay, checks the forwarding path without a network stack
+        ok = run("replay/flows:16/size:512", Trace::synthetic(16, 512, QUICK_PACKETS));
+    } else if (argc == 2) {
+        ok = run(std::string("replay/pcap:") + argv[1], Trace::loadPcap(argv[1]));
+    } else {
+        for (size_t flows : {1, 16, 256, 4096}) {
+            for (size_t size : {64, 512, 1400}) {
+                const std::string name =
+                    "replay/flows:" + std::to_string(flows) + "/size:" + std::to_string(size);
+                ok &= run(name, Trace::synthetic(flows, size, SYNTHETIC_PACKETS));
+            }
+        }
+
+        // every connected flow needs two sockets besides its client
+        struct rlimit limit;
+        if (::getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+            limit.rlim_cur = limit.rlim_max;
+            ::setrlimit(RLIMIT_NOFILE, &limit);
+        }
+
+        for (size_t flows : {1, 16, 256, 4096}) {
+            for (bool connected : {false, true}) {
+                ok &= runLoopback(connected, flows, 64);
+            }
+        }
+    }
+
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,197 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <linux/bpf.h>
+#include <sys/syscall.h>
+#include <system_error>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+// Thin wrappers over the bpf() syscall, so no libbpf is needed.
+struct Bpf {
+    // attach type of TCX ingress links (Linux 6.6), missing from older uapi headers
+    static constexpr uint32_t TCX_INGRESS = 46;
+
+    static int mapCreate(uint32_t type, uint32_t keySize, uint32_t valueSize, uint32_t maxEntries) {
+        union bpf_attr attr;
+        ::memset(&attr, 0, sizeof(attr));
+        attr.map_type = type;
+        attr.key_size = keySize;
+        attr.value_size = valueSize;
+        attr.max_entries = maxEntries;
+        return call(BPF_MAP_CREATE, attr, "bpf BPF_MAP_CREATE");
+    }
+
+    // returns false with errno set if the entry could not be written
+    static bool mapUpdate(int map, const void *key, const void *value) {
+        union bpf_attr attr;
+        ::memset(&attr, 0, sizeof(attr));
+        attr.map_fd = map;
+        attr.key = reinterpret_cast<uint64_t>(key);
+        attr.value = reinterpret_cast<uint64_t>(value);
+        attr.flags = BPF_ANY;
+        return sys(BPF_MAP_UPDATE_ELEM, attr) == 0;
+    }
+
+    static bool mapLookup(int map, const void *key, void *value) {
+        union bpf_attr attr;
+        ::memset(&attr, 0, sizeof(attr));
+        attr.map_fd = map;
+        attr.key = reinterpret_cast<uint64_t>(key);
+        attr.value = reinterpret_cast<uint64_t>(value);
+        return sys(BPF_MAP_LOOKUP_ELEM, attr) == 0;
+    }
+
+    static bool mapDelete(int map, const void *key) {
+        union bpf_attr attr;
+        ::memset(&attr, 0, sizeof(attr));
+        attr.map_fd = map;
+        attr.key = reinterpret_cast<uint64_t>(key);
+        return sys(BPF_MAP_DELETE_ELEM, attr) == 0;
+    }
+
+    static int progLoad(
+        uint32_t type,
+        const std::vector<struct bpf_insn> &insns,
+        const char *license
+    ) {
+        union bpf_attr attr;
+        ::memset(&attr, 0, sizeof(attr));
+        attr.prog_type = type;
+        attr.insns = reinterpret_cast<uint64_t>(insns.data());
+        attr.insn_cnt = insns.size();
+        attr.license = reinterpret_cast<uint64_t>(license);
+        return call(BPF_PROG_LOAD, attr, "bpf BPF_PROG_LOAD");
+    }
+
+    // the program stays attached while the returned descriptor is open
+    static int linkCreate(int prog, int ifindex, uint32_t attachType) {
+        union bpf_attr attr;
+        ::memset(&attr, 0, sizeof(attr));
+        attr.link_create.prog_fd = prog;
+        attr.link_create.target_ifindex = ifindex;
+        attr.link_create.attach_type = attachType;
+        return call(BPF_LINK_CREATE, attr, "bpf BPF_LINK_CREATE");
+    }
+
+  private:
+    static long sys(int cmd, union bpf_attr &attr) {
+        return ::syscall(__NR_bpf, cmd, &attr, sizeof(attr));
+    }
+
+    static int call(int cmd, union bpf_attr &attr, const char *what) {
+        const long fd = sys(cmd, attr);
+        if (fd < 0) {
+            throw std::system_error(errno, std::generic_category(), what);
+        }
+        return static_cast<int>(fd);
+    }
+};
+
+// Builds an eBPF program instruction by instruction, jumps refer to labels placed later.
+class BpfAsm {
+  public:
+    using Label = int;
+
+    Label label() {
+        labels.push_back(-1);
+        return labels.size() - 1;
+    }
+
+    void place(Label l) {
+        labels[l] = insns.size();
+    }
+
+    void mov(int dst, int32_t imm) {
+        emit(BPF_ALU64 | BPF_MOV | BPF_K, dst, 0, 0, imm);
+    }
+
+    void movReg(int dst, int src) {
+        emit(BPF_ALU64 | BPF_MOV | BPF_X, dst, src, 0, 0);
+    }
+
+    // 32 bit move, clears the upper half of dst
+    void movReg32(int dst, int src) {
+        emit(BPF_ALU | BPF_MOV | BPF_X, dst, src, 0, 0);
+    }
+
+    void alu(int op, int dst, int32_t imm) {
+        emit(BPF_ALU64 | op | BPF_K, dst, 0, 0, imm);
+    }
+
+    void aluReg(int op, int dst, int src) {
+        emit(BPF_ALU64 | op | BPF_X, dst, src, 0, 0);
+    }
+
+    // converts a 16 bit value loaded from the network to host order
+    void ntohs(int dst) {
+        emit(BPF_ALU | BPF_END | BPF_TO_BE, dst, 0, 0, 16);
+    }
+
+    void load(int size, int dst, int src, int16_t off) {
+        emit(BPF_LDX | size | BPF_MEM, dst, src, off, 0);
+    }
+
+    void store(int size, int dst, int16_t off, int src) {
+        emit(BPF_STX | size | BPF_MEM, dst, src, off, 0);
+    }
+
+    void atomicAdd(int size, int dst, int16_t off, int src) {
+        emit(BPF_STX | size | BPF_ATOMIC, dst, src, off, BPF_ADD);
+    }
+
+    void loadMap(int dst, int mapFd) {
+        emit(BPF_LD | BPF_DW | BPF_IMM, dst, BPF_PSEUDO_MAP_FD, 0, mapFd);
+        emit(0, 0, 0, 0, 0);
+    }
+
+    void jump(Label l) {
+        jumps.push_back({insns.size(), l});
+        emit(BPF_JMP | BPF_JA, 0, 0, 0, 0);
+    }
+
+    void jump(int op, int dst, int32_t imm, Label l) {
+        jumps.push_back({insns.size(), l});
+        emit(BPF_JMP | op | BPF_K, dst, 0, 0, imm);
+    }
+
+    void jumpReg(int op, int dst, int src, Label l) {
+        jumps.push_back({insns.size(), l});
+        emit(BPF_JMP | op | BPF_X, dst, src, 0, 0);
+    }
+
+    void call(int32_t helper) {
+        emit(BPF_JMP | BPF_CALL, 0, 0, 0, helper);
+    }
+
+    void exit() {
+        emit(BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+    }
+
+    // resolves the jumps
+    const std::vector<struct bpf_insn> &finish() {
+        for (const auto &[at, l] : jumps) {
+            insns[at].off = static_cast<int16_t>(labels[l] - at - 1);
+        }
+        jumps.clear();
+        return insns;
+    }
+
+  private:
+    void emit(uint8_t code, int dst, int src, int16_t off, int32_t imm) {
+        struct bpf_insn insn;
+        ::memset(&insn, 0, sizeof(insn));
+        insn.code = code;
+        insn.dst_reg = dst;
+        insn.src_reg = src;
+        insn.off = off;
+        insn.imm = imm;
+        insns.push_back(insn);
+    }
+
+    std::vector<struct bpf_insn> insns;
+    std::vector<int> labels;
+    std::vector<std::pair<size_t, Label>> jumps;
+};
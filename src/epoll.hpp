@@ -27,6 +27,16 @@ class Epoll {
         }
     }
 
+    // events for fd will carry ptr instead of the descriptor
+    void add(int fd, void *ptr) {
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.ptr = ptr;
+        if (::epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) < 0) {
+            throw std::system_error(errno, std::generic_category(), "epoll_ctl EPOLL_CTL_ADD");
+        }
+    }
+
     void del(int fd) {
         if (epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, NULL) < 0) {
             throw std::system_error(errno, std::generic_category(), "epoll_ctl EPOLL_CTL_DEL");
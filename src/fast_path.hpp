@@ -0,0 +1,532 @@
+#pragma once
+
+#include <arpa/inet.h>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <linux/bpf.h>
+#include <linux/if_ether.h>
+#include <linux/netlink.h>
+#include <linux/pkt_cls.h>
+#include <linux/rtnetlink.h>
+#include <net/if.h>
+#include <net/if_arp.h>
+#include <netinet/in.h>
+#include <ostream>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <system_error>
+#include <string>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+#include "bpf.hpp"
+#include "tools.hpp"
+
+// In-kernel forwarding of established IPv4 flows: a TC ingress program on one interface
+// looks up the addresses and ports of every UDP datagram in a map, and for the flows of
+// the map rewrites them the way the proxy would, XORs the payload with the mask, fixes the
+// checksums and forwards the datagram. The proxy only adds the mapping of a flow after
+// forwarding its first datagram and reads the counters of the map to expire idle flows.
+class FastPath {
+  public:
+    static constexpr uint32_t MAX_FLOWS = 65536;
+    // longer datagrams are left to the proxy, which keeps the verifier's work bounded
+    static constexpr int32_t MAX_PAYLOAD = 2048;
+
+    // addresses and ports in network order
+    struct Key {
+        uint32_t saddr;
+        uint32_t daddr;
+        uint16_t sport;
+        uint16_t dport;
+    };
+
+    struct Value {
+        Key to;           // rewritten addresses and ports
+        uint32_t ifindex; // device to send the datagram from, 0 to deliver it locally
+        uint64_t mask;
+        uint64_t packets; // counted by the program
+        uint64_t bytes;
+    };
+
+    // throws std::system_error if the interface isn't Ethernet or loopback, or if the program
+    // can't be loaded or attached, e.g. without CAP_BPF and CAP_NET_ADMIN or on kernels older
+    // than 6.6
+    FastPath(const char *ifname, const struct sockaddr_storage &listenAddr, uint64_t mask)
+        : ifname(ifname),
+          ifindex(::if_nametoindex(ifname)),
+          listenPort(reinterpret_cast<const struct sockaddr_in6 &>(listenAddr).sin6_port),
+          mask(mask) {
+        if (ifindex == 0) {
+            throw std::system_error(errno, std::generic_category(), "if_nametoindex");
+        }
+
+        routeFd = ::socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+        if (routeFd < 0) {
+            throw std::system_error(errno, std::generic_category(), "socket NETLINK_ROUTE");
+        }
+        try {
+            // the program expects an Ethernet header, which lo fakes
+            struct ifreq ifr;
+            ::memset(&ifr, 0, sizeof(ifr));
+            ::strncpy(ifr.ifr_name, ifname, IFNAMSIZ - 1);
+            if (::ioctl(routeFd, SIOCGIFHWADDR, &ifr) < 0) {
+                throw std::system_error(errno, std::generic_category(), "ioctl SIOCGIFHWADDR");
+            }
+            if (ifr.ifr_hwaddr.sa_family != ARPHRD_ETHER &&
+                ifr.ifr_hwaddr.sa_family != ARPHRD_LOOPBACK) {
+                throw std::system_error(
+                    EOPNOTSUPP, std::generic_category(), "not an Ethernet interface"
+                );
+            }
+            loopback = ifr.ifr_hwaddr.sa_family == ARPHRD_LOOPBACK;
+
+            mapFd = Bpf::mapCreate(BPF_MAP_TYPE_HASH, sizeof(Key), sizeof(Value), 2 * MAX_FLOWS);
+            progFd = Bpf::progLoad(BPF_PROG_TYPE_SCHED_CLS, program(mapFd), "Dual MIT/GPL");
+            linkFd = Bpf::linkCreate(progFd, ifindex, Bpf::TCX_INGRESS);
+        } catch (...) {
+            for (int fd : {progFd, mapFd, routeFd}) {
+                if (fd >= 0) {
+                    ::close(fd);
+                }
+            }
+            throw;
+        }
+    }
+
+    FastPath &operator=(const FastPath &) = delete;
+    FastPath &operator=(FastPath &&) = delete;
+    FastPath(const FastPath &) = delete;
+    FastPath(FastPath &&) = delete;
+
+    ~FastPath() {
+        ::close(linkFd);
+        ::close(progFd);
+        ::close(mapFd);
+        ::close(routeFd);
+    }
+
+    // adds both directions of the flow of an upstream socket, returns false if the flow has
+    // to stay in userspace: IPv6, a local peer while not on lo, or a peer routed through
+    // another interface
+    bool add(int upstream, const struct sockaddr_in6 &client) {
+        if (!IN6_IS_ADDR_V4MAPPED(&client.sin6_addr)) {
+            return false;
+        }
+        struct sockaddr_in client4;
+        ::memset(&client4, 0, sizeof(client4));
+        client4.sin_family = AF_INET;
+        client4.sin_port = client.sin6_port;
+        ::memcpy(&client4.sin_addr, &client.sin6_addr.s6_addr[12], sizeof(client4.sin_addr));
+
+        struct sockaddr_in local, dest;
+        socklen_t len = sizeof(local);
+        if (::getsockname(upstream, reinterpret_cast<struct sockaddr *>(&local), &len) < 0 ||
+            local.sin_family != AF_INET) {
+            return false;
+        }
+        len = sizeof(dest);
+        if (::getpeername(upstream, reinterpret_cast<struct sockaddr *>(&dest), &len) < 0 ||
+            dest.sin_family != AF_INET) {
+            return false;
+        }
+        Route to_dest, to_client;
+        if (!route(dest.sin_addr, &to_dest) || !route(client4.sin_addr, &to_client)) {
+            return false;
+        }
+        const int64_t dest_ifindex = egress(to_dest);
+        const int64_t client_ifindex = egress(to_client);
+        if (dest_ifindex < 0 || client_ifindex < 0) {
+            return false;
+        }
+        // replies to the client leave the listen socket from the source address of the route
+        struct sockaddr_in listen;
+        ::memset(&listen, 0, sizeof(listen));
+        listen.sin_family = AF_INET;
+        listen.sin_addr = to_client.src;
+        listen.sin_port = listenPort;
+
+        Flow flow = {client, key(client4, listen), key(dest, local), 0};
+        const Value request = {key(local, dest), static_cast<uint32_t>(dest_ifindex), mask, 0, 0};
+        const Value response = {
+            key(listen, client4), static_cast<uint32_t>(client_ifindex), mask, 0, 0
+        };
+        if (!Bpf::mapUpdate(mapFd, &flow.request, &request) ||
+            !Bpf::mapUpdate(mapFd, &flow.response, &response)) {
+            ::perror("bpf BPF_MAP_UPDATE_ELEM");
+            Bpf::mapDelete(mapFd, &flow.request);
+            return false;
+        }
+        flows[upstream] = flow;
+        return true;
+    }
+
+    void remove(int upstream) {
+        auto it = flows.find(upstream);
+        if (it == flows.end()) {
+            return;
+        }
+        Bpf::mapDelete(mapFd, &it->second.request);
+        Bpf::mapDelete(mapFd, &it->second.response);
+        flows.erase(it);
+    }
+
+    // true if the program forwarded datagrams of the flow since the previous call
+    bool active(int upstream) {
+        auto it = flows.find(upstream);
+        if (it == flows.end()) {
+            return false;
+        }
+        const uint64_t packets = counters(it->second).packets;
+        const bool changed = packets != it->second.seen;
+        it->second.seen = packets;
+        return changed;
+    }
+
+    void dump(std::ostream &out) const {
+        uint64_t packets = 0, bytes = 0;
+        for (const auto &[_, flow] : flows) {
+            const Value c = counters(flow);
+            out << "bpf "
+                << Tools::showSockaddr(reinterpret_cast<const struct sockaddr *>(&flow.client))
+                << ": packets=" << c.packets << " bytes=" << c.bytes << std::endl;
+            packets += c.packets;
+            bytes += c.bytes;
+        }
+        out << "bpf " << ifname << ": flows=" << flows.size() << " packets=" << packets
+            << " bytes=" << bytes << std::endl;
+    }
+
+  private:
+    struct Flow {
+        struct sockaddr_in6 client;
+        Key request;  // client -> listen address
+        Key response; // destination -> upstream socket
+        uint64_t seen;
+    };
+
+    static Key key(const struct sockaddr_in &from, const struct sockaddr_in &to) {
+        return {from.sin_addr.s_addr, to.sin_addr.s_addr, from.sin_port, to.sin_port};
+    }
+
+    // sum of the counters of both directions
+    Value counters(const Flow &flow) const {
+        Value sum = {}, v;
+        for (const Key *k : {&flow.request, &flow.response}) {
+            if (Bpf::mapLookup(mapFd, k, &v)) {
+                sum.packets += v.packets;
+                sum.bytes += v.bytes;
+            }
+        }
+        return sum;
+    }
+
+    struct Route {
+        unsigned char type; // RTN_LOCAL, RTN_UNICAST, ...
+        int oif;
+        struct in_addr src; // preferred source address
+    };
+
+    // asks the kernel for its route to dst, like ip route get, so policy routing and
+    // ip_nonlocal_bind don't matter
+    bool route(struct in_addr dst, Route *res) {
+        struct {
+            struct nlmsghdr nh;
+            struct rtmsg rt;
+            struct rtattr attr;
+            struct in_addr dst;
+        } req;
+        ::memset(&req, 0, sizeof(req));
+        req.nh.nlmsg_len = sizeof(req);
+        req.nh.nlmsg_type = RTM_GETROUTE;
+        req.nh.nlmsg_flags = NLM_F_REQUEST;
+        req.nh.nlmsg_seq = ++routeSeq;
+        req.rt.rtm_family = AF_INET;
+        req.rt.rtm_dst_len = 32;
+        req.attr.rta_type = RTA_DST;
+        req.attr.rta_len = RTA_LENGTH(sizeof(dst));
+        req.dst = dst;
+        if (::send(routeFd, &req, sizeof(req), 0) < 0) {
+            ::perror("send RTM_GETROUTE");
+            return false;
+        }
+
+        // the answer is queued before send returns, skip the ones to earlier failed requests
+        alignas(struct nlmsghdr) char buf[4096];
+        for (;;) {
+            const ssize_t n = ::recv(routeFd, buf, sizeof(buf), MSG_DONTWAIT);
+            if (n < 0) {
+                ::perror("recv RTM_GETROUTE");
+                return false;
+            }
+            int len = static_cast<int>(n);
+            for (auto *nh = reinterpret_cast<struct nlmsghdr *>(buf); NLMSG_OK(nh, len);
+                 nh = NLMSG_NEXT(nh, len)) {
+                if (nh->nlmsg_seq != routeSeq) {
+                    continue;
+                }
+                if (nh->nlmsg_type != RTM_NEWROUTE) {
+                    return false; // NLMSG_ERROR, e.g. ENETUNREACH
+                }
+                const auto *rt = static_cast<const struct rtmsg *>(NLMSG_DATA(nh));
+                res->type = rt->rtm_type;
+                res->oif = 0;
+                res->src.s_addr = INADDR_ANY;
+                int attr_len = RTM_PAYLOAD(nh);
+                for (const auto *attr = RTM_RTA(rt); RTA_OK(attr, attr_len);
+                     attr = RTA_NEXT(attr, attr_len)) {
+                    if (attr->rta_type == RTA_OIF) {
+                        ::memcpy(&res->oif, RTA_DATA(attr), sizeof(res->oif));
+                    } else if (attr->rta_type == RTA_PREFSRC) {
+                        ::memcpy(&res->src, RTA_DATA(attr), sizeof(res->src));
+                    }
+                }
+                return res->src.s_addr != INADDR_ANY;
+            }
+        }
+    }
+
+    // the ifindex to forward datagrams following the route through: 0 for local destinations,
+    // the interface of the program if the route leaves through it, -1 otherwise. Only on lo
+    // local datagrams may carry local source addresses, elsewhere they are martians.
+    int64_t egress(const Route &r) const {
+        if (r.type == RTN_LOCAL) {
+            return loopback ? 0 : -1;
+        }
+        return r.type == RTN_UNICAST && r.oif == ifindex ? ifindex : -1;
+    }
+
+    // packet offsets, the program sees the frame from the Ethernet header
+    static constexpr int16_t ETH_PROTO = 12;
+    static constexpr int16_t IP = 14;
+    static constexpr int16_t IP_FRAG = IP + 6;
+    static constexpr int16_t IP_PROTO = IP + 9;
+    static constexpr int16_t IP_CSUM = IP + 10;
+    static constexpr int16_t IP_SADDR = IP + 12;
+    static constexpr int16_t UDP = IP + 20;
+    static constexpr int16_t UDP_LEN = UDP + 4;
+    static constexpr int16_t UDP_CSUM = UDP + 6;
+    static constexpr int16_t PAYLOAD = UDP + 8;
+
+    // stack copy of the headers, placed so that the addresses and ports are word aligned
+    static constexpr int16_t HDR = -70;
+    static constexpr int16_t KEY = HDR + IP_SADDR; // the addresses and ports form the key
+    static constexpr int16_t ADDR_DIFF = -8;       // checksum difference of the addresses
+
+    // adds the one's complement difference between the words in old_reg and new_reg to r9,
+    // as 32 bit halves
+    static void csumDiff(BpfAsm &a, int old_reg, int new_reg) {
+        a.movReg(BPF_REG_0, old_reg);
+        a.alu(BPF_XOR, BPF_REG_0, -1);
+        a.movReg32(BPF_REG_1, BPF_REG_0);
+        a.aluReg(BPF_ADD, BPF_REG_9, BPF_REG_1);
+        a.alu(BPF_RSH, BPF_REG_0, 32);
+        a.aluReg(BPF_ADD, BPF_REG_9, BPF_REG_0);
+        a.movReg32(BPF_REG_1, new_reg);
+        a.aluReg(BPF_ADD, BPF_REG_9, BPF_REG_1);
+        a.movReg(BPF_REG_0, new_reg);
+        a.alu(BPF_RSH, BPF_REG_0, 32);
+        a.aluReg(BPF_ADD, BPF_REG_9, BPF_REG_0);
+    }
+
+    // folds r9 to 32 bits
+    static void csumFold(BpfAsm &a) {
+        for (int i = 0; i < 2; i++) {
+            a.movReg(BPF_REG_0, BPF_REG_9);
+            a.alu(BPF_RSH, BPF_REG_0, 32);
+            a.movReg32(BPF_REG_9, BPF_REG_9);
+            a.aluReg(BPF_ADD, BPF_REG_9, BPF_REG_0);
+        }
+    }
+
+    // loads skb->data to r2 and skb->data_end to r3, jumps to fail if the headers are short
+    static void packet(BpfAsm &a, BpfAsm::Label fail) {
+        a.load(BPF_W, BPF_REG_2, BPF_REG_6, offsetof(struct __sk_buff, data));
+        a.load(BPF_W, BPF_REG_3, BPF_REG_6, offsetof(struct __sk_buff, data_end));
+        a.movReg(BPF_REG_1, BPF_REG_2);
+        a.alu(BPF_ADD, BPF_REG_1, PAYLOAD);
+        a.jumpReg(BPF_JGT, BPF_REG_1, BPF_REG_3, fail);
+    }
+
+    // r6 skb, r7 map value, r8 payload bytes left, r9 checksum difference
+    static std::vector<struct bpf_insn> program(int map) {
+        BpfAsm a;
+        const auto pass = a.label();
+        const auto words = a.label();
+        const auto tail = a.label();
+        const auto bytes = a.label();
+        const auto rewrite = a.label();
+
+        // the checks and the lookup read a copy of the headers, so the datagrams of other
+        // flows reach the stack with their skb untouched
+        a.movReg(BPF_REG_6, BPF_REG_1);
+        a.mov(BPF_REG_2, 0);
+        a.movReg(BPF_REG_3, BPF_REG_10);
+        a.alu(BPF_ADD, BPF_REG_3, HDR);
+        a.mov(BPF_REG_4, PAYLOAD);
+        a.call(BPF_FUNC_skb_load_bytes);
+        a.jump(BPF_JNE, BPF_REG_0, 0, pass);
+
+        // unfragmented IPv4 UDP without options
+        a.load(BPF_H, BPF_REG_1, BPF_REG_10, HDR + ETH_PROTO);
+        a.jump(BPF_JNE, BPF_REG_1, htons(ETH_P_IP), pass);
+        a.load(BPF_B, BPF_REG_1, BPF_REG_10, HDR + IP);
+        a.jump(BPF_JNE, BPF_REG_1, 0x45, pass);
+        a.load(BPF_B, BPF_REG_1, BPF_REG_10, HDR + IP_PROTO);
+        a.jump(BPF_JNE, BPF_REG_1, IPPROTO_UDP, pass);
+        a.load(BPF_H, BPF_REG_1, BPF_REG_10, HDR + IP_FRAG);
+        a.alu(BPF_AND, BPF_REG_1, htons(0x3fff));
+        a.jump(BPF_JNE, BPF_REG_1, 0, pass);
+
+        a.loadMap(BPF_REG_1, map);
+        a.movReg(BPF_REG_2, BPF_REG_10);
+        a.alu(BPF_ADD, BPF_REG_2, KEY);
+        a.call(BPF_FUNC_map_lookup_elem);
+        a.jump(BPF_JEQ, BPF_REG_0, 0, pass);
+        a.movReg(BPF_REG_7, BPF_REG_0);
+
+        // only now the whole datagram is made linear and writable
+        a.load(BPF_H, BPF_REG_8, BPF_REG_10, HDR + UDP_LEN);
+        a.ntohs(BPF_REG_8);
+        a.jump(BPF_JLT, BPF_REG_8, 8, pass);
+        a.alu(BPF_SUB, BPF_REG_8, 8);
+        a.jump(BPF_JGT, BPF_REG_8, MAX_PAYLOAD, pass);
+        a.movReg(BPF_REG_1, BPF_REG_6);
+        a.movReg(BPF_REG_2, BPF_REG_8);
+        a.alu(BPF_ADD, BPF_REG_2, PAYLOAD);
+        a.call(BPF_FUNC_skb_pull_data);
+        a.jump(BPF_JNE, BPF_REG_0, 0, pass);
+        packet(a, pass);
+        a.movReg(BPF_REG_1, BPF_REG_2);
+        a.alu(BPF_ADD, BPF_REG_1, PAYLOAD);
+        a.aluReg(BPF_ADD, BPF_REG_1, BPF_REG_8);
+        a.jumpReg(BPF_JGT, BPF_REG_1, BPF_REG_3, pass);
+
+        // the addresses are in the pseudo header, the ports only in the UDP checksum
+        a.mov(BPF_REG_9, 0);
+        for (int16_t off : {offsetof(Key, saddr), offsetof(Key, daddr)}) {
+            a.load(BPF_W, BPF_REG_4, BPF_REG_10, KEY + off);
+            a.load(BPF_W, BPF_REG_5, BPF_REG_7, offsetof(Value, to) + off);
+            csumDiff(a, BPF_REG_4, BPF_REG_5);
+        }
+        csumFold(a);
+        a.store(BPF_DW, BPF_REG_10, ADDR_DIFF, BPF_REG_9);
+        a.mov(BPF_REG_9, 0);
+        a.load(BPF_W, BPF_REG_4, BPF_REG_10, KEY + static_cast<int16_t>(offsetof(Key, sport)));
+        a.load(BPF_W, BPF_REG_5, BPF_REG_7, offsetof(Value, to) + offsetof(Key, sport));
+        csumDiff(a, BPF_REG_4, BPF_REG_5);
+
+        // XOR the payload by words, like Tools::xor_block
+        a.alu(BPF_ADD, BPF_REG_2, PAYLOAD);
+        a.place(words);
+        a.jump(BPF_JLT, BPF_REG_8, 8, tail);
+        a.movReg(BPF_REG_1, BPF_REG_2);
+        a.alu(BPF_ADD, BPF_REG_1, 8);
+        a.jumpReg(BPF_JGT, BPF_REG_1, BPF_REG_3, pass);
+        a.load(BPF_DW, BPF_REG_4, BPF_REG_2, 0);
+        a.load(BPF_DW, BPF_REG_5, BPF_REG_7, offsetof(Value, mask));
+        a.aluReg(BPF_XOR, BPF_REG_5, BPF_REG_4);
+        a.store(BPF_DW, BPF_REG_2, 0, BPF_REG_5);
+        csumDiff(a, BPF_REG_4, BPF_REG_5);
+        a.alu(BPF_ADD, BPF_REG_2, 8);
+        a.alu(BPF_SUB, BPF_REG_8, 8);
+        a.jump(words);
+
+        // and the last bytes one by one, collecting them into a word for the checksum:
+        // r4 the old bytes, r5 the shift of the next one
+        a.place(tail);
+        a.mov(BPF_REG_4, 0);
+        a.mov(BPF_REG_5, 0);
+        a.place(bytes);
+        a.jump(BPF_JEQ, BPF_REG_8, 0, rewrite);
+        a.movReg(BPF_REG_1, BPF_REG_2);
+        a.alu(BPF_ADD, BPF_REG_1, 1);
+        a.jumpReg(BPF_JGT, BPF_REG_1, BPF_REG_3, pass);
+        a.load(BPF_B, BPF_REG_0, BPF_REG_2, 0);
+        a.movReg(BPF_REG_1, BPF_REG_0);
+        a.aluReg(BPF_LSH, BPF_REG_1, BPF_REG_5);
+        a.aluReg(BPF_OR, BPF_REG_4, BPF_REG_1);
+        a.load(BPF_DW, BPF_REG_1, BPF_REG_7, offsetof(Value, mask));
+        a.aluReg(BPF_RSH, BPF_REG_1, BPF_REG_5);
+        a.aluReg(BPF_XOR, BPF_REG_0, BPF_REG_1);
+        a.store(BPF_B, BPF_REG_2, 0, BPF_REG_0);
+        a.alu(BPF_ADD, BPF_REG_2, 1);
+        a.alu(BPF_ADD, BPF_REG_5, 8);
+        a.alu(BPF_SUB, BPF_REG_8, 1);
+        a.jump(bytes);
+
+        a.place(rewrite);
+        a.mov(BPF_REG_0, 1);
+        a.aluReg(BPF_LSH, BPF_REG_0, BPF_REG_5);
+        a.alu(BPF_SUB, BPF_REG_0, 1);
+        a.load(BPF_DW, BPF_REG_5, BPF_REG_7, offsetof(Value, mask));
+        a.aluReg(BPF_AND, BPF_REG_5, BPF_REG_0);
+        a.aluReg(BPF_XOR, BPF_REG_5, BPF_REG_4);
+        csumDiff(a, BPF_REG_4, BPF_REG_5);
+        csumFold(a);
+
+        packet(a, pass);
+        for (int16_t off = 0; off < static_cast<int16_t>(sizeof(Key)); off += 4) {
+            a.load(BPF_W, BPF_REG_1, BPF_REG_7, offsetof(Value, to) + off);
+            a.store(BPF_W, BPF_REG_2, IP_SADDR + off, BPF_REG_1);
+        }
+
+        a.movReg(BPF_REG_1, BPF_REG_6);
+        a.mov(BPF_REG_2, IP_CSUM);
+        a.mov(BPF_REG_3, 0);
+        a.load(BPF_DW, BPF_REG_4, BPF_REG_10, ADDR_DIFF);
+        a.mov(BPF_REG_5, 0);
+        a.call(BPF_FUNC_l3_csum_replace);
+        a.movReg(BPF_REG_1, BPF_REG_6);
+        a.mov(BPF_REG_2, UDP_CSUM);
+        a.mov(BPF_REG_3, 0);
+        a.load(BPF_DW, BPF_REG_4, BPF_REG_10, ADDR_DIFF);
+        a.mov(BPF_REG_5, BPF_F_PSEUDO_HDR | BPF_F_MARK_MANGLED_0);
+        a.call(BPF_FUNC_l4_csum_replace);
+        a.movReg(BPF_REG_1, BPF_REG_6);
+        a.mov(BPF_REG_2, UDP_CSUM);
+        a.mov(BPF_REG_3, 0);
+        a.movReg(BPF_REG_4, BPF_REG_9);
+        a.mov(BPF_REG_5, BPF_F_MARK_MANGLED_0);
+        a.call(BPF_FUNC_l4_csum_replace);
+
+        a.mov(BPF_REG_1, 1);
+        a.atomicAdd(BPF_DW, BPF_REG_7, offsetof(Value, packets), BPF_REG_1);
+        a.load(BPF_W, BPF_REG_1, BPF_REG_6, offsetof(struct __sk_buff, len));
+        a.atomicAdd(BPF_DW, BPF_REG_7, offsetof(Value, bytes), BPF_REG_1);
+
+        // locally delivered datagrams continue up the stack with the new addresses
+        const auto local = a.label();
+        a.load(BPF_W, BPF_REG_1, BPF_REG_7, offsetof(Value, ifindex));
+        a.jump(BPF_JEQ, BPF_REG_1, 0, local);
+        a.mov(BPF_REG_2, 0);
+        a.mov(BPF_REG_3, 0);
+        a.mov(BPF_REG_4, 0);
+        a.call(BPF_FUNC_redirect_neigh);
+        a.exit();
+        a.place(local);
+        a.mov(BPF_REG_0, TC_ACT_OK);
+        a.exit();
+
+        a.place(pass);
+        a.mov(BPF_REG_0, TC_ACT_UNSPEC); // let the next program or the stack have it
+        a.exit();
+        return a.finish();
+    }
+
+    const std::string ifname;
+    const int ifindex;
+    const uint16_t listenPort;
+    const uint64_t mask;
+    bool loopback = false;
+
+    int routeFd = -1; // NETLINK_ROUTE socket for the route lookups
+    uint32_t routeSeq = 0;
+    int mapFd = -1;
+    int progFd = -1;
+    int linkFd = -1;
+
+    std::unordered_map<int, Flow> flows; // by upstream socket
+};
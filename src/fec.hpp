@@ -0,0 +1,291 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <netinet/in.h>
+#include <vector>
+
+// Forward error correction between two paired proxies: on the link side every datagram
+// gets a header with its group and index, and after every `group` datagrams of a flow a
+// parity datagram with the XOR of their payloads and lengths is sent. The receiving proxy
+// rebuilds a single lost datagram per group while the group is inside its window.
+
+struct FecStats {
+    uint64_t sent;      // data datagrams sent to the link
+    uint64_t paritySent;
+    uint64_t received;  // data datagrams received from the link
+    uint64_t recovered; // rebuilt from parity
+    uint64_t lost;      // missing from groups that left the window
+    uint64_t dropped;   // duplicate, late or malformed
+};
+
+// 8 bytes in front of the payload, so the payload keeps its alignment to the XOR mask
+struct FecHeader {
+    static constexpr size_t SIZE = 8;
+    static constexpr uint8_t PARITY = 0xff;
+    static constexpr unsigned int MAX_GROUP = 64;
+
+    uint32_t group;
+    uint8_t index;   // position in the group or PARITY
+    uint8_t count;   // datagrams in the group
+    uint16_t lenXor; // parity: XOR of the lengths of the group's datagrams
+
+    void write(uint8_t *p, uint64_t mask) const {
+        const uint8_t bytes[SIZE] = {
+            static_cast<uint8_t>(group >> 24),
+            static_cast<uint8_t>(group >> 16),
+            static_cast<uint8_t>(group >> 8),
+            static_cast<uint8_t>(group),
+            index,
+            count,
+            static_cast<uint8_t>(lenXor >> 8),
+            static_cast<uint8_t>(lenXor),
+        };
+        uint64_t word;
+        ::memcpy(&word, bytes, SIZE);
+        word ^= mask;
+        ::memcpy(p, &word, SIZE);
+    }
+
+    static FecHeader read(const uint8_t *p, uint64_t mask) {
+        uint64_t word;
+        ::memcpy(&word, p, SIZE);
+        word ^= mask;
+        uint8_t b[SIZE];
+        ::memcpy(b, &word, SIZE);
+        return {
+            static_cast<uint32_t>(b[0]) << 24 | b[1] << 16 | b[2] << 8 | b[3],
+            b[4],
+            b[5],
+            static_cast<uint16_t>(b[6] << 8 | b[7])
+        };
+    }
+};
+
+struct Fec {
+    // dst ^= src, in 32 byte vectors
+#if defined(__x86_64__)
+    [[gnu::target_clones("avx2", "default")]]
+#endif
+    static void xorInto(uint8_t *dst, const uint8_t *src, size_t len) {
+        typedef uint8_t Block __attribute__((vector_size(32)));
+        size_t i = 0;
+        for (; i + sizeof(Block) <= len; i += sizeof(Block)) {
+            Block a, b;
+            ::memcpy(&a, dst + i, sizeof(a));
+            ::memcpy(&b, src + i, sizeof(b));
+            a ^= b;
+            ::memcpy(dst + i, &a, sizeof(a));
+        }
+        for (; i < len; i++) {
+            dst[i] ^= src[i];
+        }
+    }
+};
+
+class FecEncoder {
+  public:
+    explicit FecEncoder(unsigned int groupSize)
+        : groupSize(groupSize),
+          parityBuf(FecHeader::SIZE) {}
+
+    // writes the header in the FecHeader::SIZE bytes before the payload, returns true if the
+    // datagram completed a group and parity() holds the parity datagram until the next call
+    bool add(uint8_t *payload, size_t len, uint64_t mask, FecStats &stats) {
+        if (index == groupSize) { // start the next group
+            ::memset(parityBuf.data() + FecHeader::SIZE, 0, maxLen);
+            group += 1;
+            index = 0;
+            lenXor = 0;
+            maxLen = 0;
+        }
+
+        FecHeader{group, index, static_cast<uint8_t>(groupSize), 0}.write(
+            payload - FecHeader::SIZE, mask
+        );
+
+        if (FecHeader::SIZE + len > parityBuf.size()) {
+            parityBuf.resize(FecHeader::SIZE + len);
+        }
+        Fec::xorInto(parityBuf.data() + FecHeader::SIZE, payload, len);
+        maxLen = std::max(maxLen, len);
+        lenXor ^= static_cast<uint16_t>(len);
+        index += 1;
+        stats.sent += 1;
+
+        if (index < groupSize) {
+            return false;
+        }
+        FecHeader{group, FecHeader::PARITY, static_cast<uint8_t>(groupSize), lenXor}.write(
+            parityBuf.data(), mask
+        );
+        stats.paritySent += 1;
+        return true;
+    }
+
+    const uint8_t *parity() const {
+        return parityBuf.data();
+    }
+
+    size_t parityLen() const {
+        return FecHeader::SIZE + maxLen;
+    }
+
+  private:
+    const uint8_t groupSize;
+    uint32_t group = 0;
+    uint8_t index = 0;
+    uint16_t lenXor = 0;
+    size_t maxLen = 0;
+    std::vector<uint8_t> parityBuf;
+};
+
+class FecDecoder {
+  public:
+    struct Result {
+        uint8_t *data; // payload of the received datagram, null for parity or a drop
+        size_t len;
+        uint8_t *recovered; // a datagram rebuilt by this one, valid until the next call
+        size_t recoveredLen;
+    };
+
+    explicit FecDecoder(unsigned int window)
+        : groups(window) {}
+
+    Result receive(uint8_t *buf, size_t len, uint64_t mask, FecStats &stats) {
+        Result res = {nullptr, 0, nullptr, 0};
+        if (len < FecHeader::SIZE) {
+            stats.dropped += 1;
+            return res;
+        }
+
+        const FecHeader hdr = FecHeader::read(buf, mask);
+        const bool parity = hdr.index == FecHeader::PARITY;
+        if (hdr.count == 0 || hdr.count > FecHeader::MAX_GROUP ||
+            (!parity && hdr.index >= hdr.count)) {
+            stats.dropped += 1;
+            return res;
+        }
+
+        if (!started) {
+            started = true;
+            newest = hdr.group;
+        }
+        const uint32_t window = groups.size();
+        const int32_t age = static_cast<int32_t>(newest - hdr.group);
+        if (age >= static_cast<int32_t>(window)) {
+            // the encoder of the paired proxy counts from 0 again after it expired the flow
+            // or restarted, anything else this old may have been rebuilt already
+            if (hdr.group >= window) {
+                stats.dropped += 1;
+                return res;
+            }
+            for (Group &g : groups) {
+                retire(g, stats);
+            }
+            newest = hdr.group;
+        } else if (age < 0) {
+            newest = hdr.group;
+        }
+
+        Group &g = groups[hdr.group % groups.size()];
+        if (!g.used || g.id != hdr.group) {
+            retire(g, stats);
+            g.used = true;
+            g.id = hdr.group;
+            g.count = hdr.count;
+        }
+
+        uint8_t *const payload = buf + FecHeader::SIZE;
+        const size_t payload_len = len - FecHeader::SIZE;
+
+        if (parity) {
+            if (g.parity) {
+                stats.dropped += 1;
+                return res;
+            }
+            g.parity = true;
+            g.count = hdr.count;
+            g.lenXor ^= hdr.lenXor;
+        } else {
+            const uint64_t bit = uint64_t(1) << hdr.index;
+            if (g.received & bit) {
+                stats.dropped += 1;
+                return res;
+            }
+            g.received |= bit;
+            g.lenXor ^= static_cast<uint16_t>(payload_len);
+            stats.received += 1;
+            res.data = payload;
+            res.len = payload_len;
+        }
+
+        if (g.done) {
+            return res;
+        }
+        if (payload_len > g.acc.size()) {
+            g.acc.resize(payload_len);
+        }
+        Fec::xorInto(g.acc.data(), payload, payload_len);
+        g.accLen = std::max(g.accLen, payload_len);
+
+        const unsigned int have = __builtin_popcountll(g.received);
+        if (have == g.count) {
+            g.done = true;
+        } else if (g.parity && have + 1 == g.count && g.lenXor <= g.accLen) {
+            const uint64_t all = g.count == 64 ? ~uint64_t(0) : (uint64_t(1) << g.count) - 1;
+            g.received |= all & ~g.received;
+            g.done = true;
+            stats.recovered += 1;
+            res.recovered = g.acc.data();
+            res.recoveredLen = g.lenXor;
+        }
+        return res;
+    }
+
+  private:
+    struct Group {
+        uint32_t id = 0;
+        bool used = false;
+        bool parity = false;
+        bool done = false;
+        uint8_t count = 0;
+        uint16_t lenXor = 0;
+        uint64_t received = 0;
+        size_t accLen = 0;
+        std::vector<uint8_t> acc; // XOR of the payloads received so far
+    };
+
+    static void retire(Group &g, FecStats &stats) {
+        if (g.used && !g.done) {
+            stats.lost += g.count - __builtin_popcountll(g.received);
+        }
+        if (g.accLen) {
+            ::memset(g.acc.data(), 0, g.accLen);
+        }
+        g.used = false;
+        g.parity = false;
+        g.done = false;
+        g.lenXor = 0;
+        g.received = 0;
+        g.accLen = 0;
+    }
+
+    std::vector<Group> groups;
+    uint32_t newest = 0;
+    bool started = false;
+};
+
+// FEC state of one client flow
+struct FecFlow {
+    FecFlow(const struct sockaddr_in6 &client, unsigned int groupSize, unsigned int window)
+        : client(client),
+          encoder(groupSize),
+          decoder(window) {}
+
+    struct sockaddr_in6 client;
+    FecEncoder encoder;
+    FecDecoder decoder;
+    FecStats stats = {};
+};
@@ -0,0 +1,489 @@
+#include "forwarder.hpp"
+
+#include <cstdio>
+#include <cstring>
+#include <unistd.h>
+
+#include "tools.hpp"
+
+Forwarder::Forwarder(PacketIo &io, int listenFd, uint64_t mask, const ForwarderOptions &options)
+    : io(io),
+      listenFd(listenFd),
+      mask(mask),
+      tracer(options.tracer),
+      connected(options.connected),
+      options(options),
+      extras(MAX_MSGS),
+      buffers(new unsigned char[MAX_MSGS * BUFFER_SIZE]) {
+    ::memset(&msgs, 0, sizeof(msgs));
+    ::memset(&msgsNoAddr, 0, sizeof(msgsNoAddr));
+    ::memset(&msgsCommonAddr, 0, sizeof(msgsCommonAddr));
+    ::memset(&msgsConnected, 0, sizeof(msgsConnected));
+    ::memset(&iovecsConst, 0, sizeof(iovecsConst));
+    ::memset(&iovecsMut, 0, sizeof(iovecsMut));
+    ::memset(&iovecsConnected, 0, sizeof(iovecsConnected));
+    ::memset(&reqAddrs, 0, sizeof(reqAddrs));
+    ::memset(&respCommonAddr, 0, sizeof(respCommonAddr));
+    ::memset(&sampled, 0, sizeof(sampled));
+
+    for (int i = 0; i < MAX_MSGS; i++) {
+        // room for a FEC header in front of the datagram
+        iovecsConst[i].iov_base = &buffers[i * BUFFER_SIZE + FecHeader::SIZE];
+        iovecsConst[i].iov_len = BUFFER_SIZE - FecHeader::SIZE;
+
+        msgs[i].msg_hdr.msg_name = &reqAddrs[i];
+        msgs[i].msg_hdr.msg_namelen = sizeof(reqAddrs[i]);
+        msgs[i].msg_hdr.msg_iov = &iovecsConst[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_control = controls[i];
+
+        msgsNoAddr[i].msg_hdr.msg_iov = &iovecsConst[i];
+        msgsNoAddr[i].msg_hdr.msg_iovlen = 1;
+        msgsNoAddr[i].msg_hdr.msg_control = controls[i];
+    }
+
+    for (int i = 0; i < MAX_OUT; i++) {
+        msgsCommonAddr[i].msg_hdr.msg_name = &respCommonAddr;
+        msgsCommonAddr[i].msg_hdr.msg_namelen = sizeof(respCommonAddr);
+        msgsCommonAddr[i].msg_hdr.msg_iov = &iovecsMut[i];
+        msgsCommonAddr[i].msg_hdr.msg_iovlen = 1;
+
+        msgsConnected[i].msg_hdr.msg_iov = &iovecsConnected[i];
+        msgsConnected[i].msg_hdr.msg_iovlen = 1;
+    }
+}
+
+void Forwarder::onListenReadable() {
+    for (int i = 0; i < MAX_MSGS; i += 1) {
+        msgs[i].msg_hdr.msg_namelen = sizeof(reqAddrs[i]);
+        msgs[i].msg_hdr.msg_controllen = tracer ? sizeof(controls[i]) : 0;
+    }
+
+    const int msg_count = io.recvBatch(listenFd, msgs, MAX_MSGS);
+    if (msg_count < 0) {
+        ::perror("recvmmsg");
+        return;
+    }
+    const uint64_t recv_time = tracer ? LatencyTracer::now() : 0;
+    extrasUsed = 0;
+
+    for (int i = 0; i < msg_count; i += 1) {
+        uint8_t *const buf = (uint8_t *)msgs[i].msg_hdr.msg_iov->iov_base;
+        const size_t recv_len = msgs[i].msg_len;
+
+        struct sockaddr_in6 &client_addr =
+            *reinterpret_cast<struct sockaddr_in6 *>(msgs[i].msg_hdr.msg_name);
+
+        sample(i, msgs[i].msg_hdr, recv_len, recv_time, Direction::Request);
+        LatencySample *const sample = sampled[i] ? &samples[i] : nullptr;
+        sampled[i] = false;
+
+        if (connected) {
+            sendToFlow(client_addr, buf, recv_len, sample);
+            continue;
+        }
+
+        auto sock = table.find(client_addr);
+        if (sock != nullptr) {
+            if (forwardRequest(*sock, fecFlow(*sock, client_addr), buf, recv_len, sample) < 0) {
+                ::perror("send");
+                continue;
+            }
+        } else {
+            auto sock = io.openUpstream();
+            if (forwardRequest(sock, fecFlow(sock, client_addr), buf, recv_len, sample) < 0) {
+                ::perror("send");
+                dropUpstream(sock);
+                continue;
+            }
+            table.add(sock, client_addr);
+            if (options.fastPath) {
+                options.fastPath->add(sock, client_addr);
+            }
+        }
+    }
+}
+
+void Forwarder::onUpstreamReadable(int sock) {
+    for (int i = 0; i < MAX_MSGS; i += 1) {
+        msgsNoAddr[i].msg_hdr.msg_controllen = tracer ? sizeof(controls[i]) : 0;
+    }
+
+    int msg_cnt = io.recvBatch(sock, msgsNoAddr, MAX_MSGS);
+    if (msg_cnt < 0) {
+        ::perror("recvmmsg");
+        table.erase(sock);
+        dropUpstream(sock);
+        return;
+    }
+
+    const uint64_t recv_time = tracer ? LatencyTracer::now() : 0;
+    respCommonAddr = *table.find(sock);
+    FecFlow *const fec = fecFlow(sock, respCommonAddr);
+    extrasUsed = 0;
+
+    int out_cnt = 0;
+    for (int i = 0; i < msg_cnt; i += 1) {
+        uint8_t *const buf = (uint8_t *)iovecsConst[i].iov_base;
+        const Direction dir = Direction::Response;
+        const int n = prepare(fec, dir, buf, msgsNoAddr[i].msg_len, &iovecsMut[out_cnt]);
+        if (n > 0) {
+            sample(out_cnt, msgsNoAddr[i].msg_hdr, iovecsMut[out_cnt].iov_len, recv_time, dir);
+            out_cnt += n;
+        }
+    }
+
+    sendBatch(listenFd, msgsCommonAddr, out_cnt, recv_time);
+}
+
+void Forwarder::onFlowReadable(FlowSide *side) {
+    if (side->fd < 0) { // closed earlier in this batch of events
+        return;
+    }
+    Flow &flow = *side->flow;
+    flow.used = true;
+
+    // datagrams queued on a client socket before connect() may come from other clients
+    const bool check_source = side->dir == Direction::Request;
+    struct mmsghdr *const in = check_source ? msgs : msgsNoAddr;
+    for (int i = 0; i < MAX_MSGS; i += 1) {
+        in[i].msg_hdr.msg_namelen = check_source ? sizeof(reqAddrs[i]) : 0;
+        in[i].msg_hdr.msg_controllen = tracer ? sizeof(controls[i]) : 0;
+    }
+
+    const int msg_cnt = io.recvBatch(side->fd, in, MAX_MSGS);
+    if (msg_cnt < 0) {
+        ::perror("recvmmsg");
+        closeFlow(flow);
+        return;
+    }
+    const uint64_t recv_time = tracer ? LatencyTracer::now() : 0;
+    extrasUsed = 0;
+
+    int out_cnt = 0;
+    for (int i = 0; i < msg_cnt; i += 1) {
+        uint8_t *const buf = (uint8_t *)in[i].msg_hdr.msg_iov->iov_base;
+        const size_t recv_len = in[i].msg_len;
+
+        if (check_source && !(reqAddrs[i] == flow.addr)) {
+            sendToFlow(reqAddrs[i], buf, recv_len, nullptr);
+            continue;
+        }
+
+        const int n = prepare(flow.fec.get(), side->dir, buf, recv_len, &iovecsConnected[out_cnt]);
+        if (n > 0) {
+            sample(out_cnt, in[i].msg_hdr, iovecsConnected[out_cnt].iov_len, recv_time, side->dir);
+            out_cnt += n;
+        }
+    }
+
+    if (side->fd < 0) { // closed while sending datagrams of other clients
+        return;
+    }
+    FlowSide &peer = side->dir == Direction::Request ? flow.upstream : flow.client;
+    sendBatch(peer.fd, msgsConnected, out_cnt, recv_time);
+}
+
+void Forwarder::onTimer() {
+    // datagrams forwarded by the kernel never reach the table
+    if (options.fastPath) {
+        for (auto &[sock, entry] : table.s2a) {
+            if (options.fastPath->active(sock)) {
+                std::get<1>(entry) = true;
+            }
+        }
+    }
+    table.cleanup([&](int sock, const struct sockaddr_in6 &) { dropUpstream(sock); });
+
+    for (auto it = connectedFlows.begin(); it != connectedFlows.end();) {
+        Flow &flow = *it->second;
+        if (flow.used) {
+            flow.used = false;
+            it++;
+        } else {
+            it++;
+            closeFlow(flow);
+        }
+    }
+}
+
+bool Forwarder::closeAll() {
+    bool ok = true;
+    // the listen socket stays open, but the samples sent through it have to be counted
+    if (tracer) {
+        tracer->drainErrQueue(listenFd);
+        tracer->forget(listenFd);
+    }
+    for (const auto &[sock, _] : table.s2a) {
+        if (tracer) {
+            tracer->forget(sock);
+        }
+        if (options.fastPath) {
+            options.fastPath->remove(sock);
+        }
+        if (io.closeUpstream(sock) < 0) {
+            ::perror("close");
+            ok = false;
+        }
+    }
+    table.s2a.clear();
+    table.a2s.clear();
+    fecFlows.clear();
+
+    while (!connectedFlows.empty()) {
+        if (closeFlow(*connectedFlows.begin()->second) < 0) {
+            ::perror("close");
+            ok = false;
+        }
+    }
+    reap();
+    return ok;
+}
+
+void Forwarder::dump(std::ostream &out) const {
+    if (options.fastPath) {
+        options.fastPath->dump(out);
+    }
+    if (!options.fec) {
+        return;
+    }
+
+    auto print = [&](const FecFlow &fec) {
+        const auto &s = fec.stats;
+        out << "fec " << Tools::showSockaddr(reinterpret_cast<const struct sockaddr *>(&fec.client))
+            << ": sent=" << s.sent << " parity=" << s.paritySent << " received=" << s.received
+            << " recovered=" << s.recovered << " lost=" << s.lost << " dropped=" << s.dropped
+            << std::endl;
+    };
+    for (const auto &[_, fec] : fecFlows) {
+        print(*fec);
+    }
+    for (const auto &[_, flow] : connectedFlows) {
+        print(*flow->fec);
+    }
+}
+
+int Forwarder::prepare(FecFlow *fec, Direction dir, uint8_t *buf, size_t len, struct iovec *out) {
+    if (fec == nullptr) {
+        unmask(buf, len);
+        out[0] = {buf, len};
+        return 1;
+    }
+
+    if (!options.encodes(dir)) {
+        const auto res = fec->decoder.receive(buf, len, options.fecMask, fec->stats);
+        int n = 0;
+        if (res.data) {
+            unmask(res.data, res.len);
+            out[n++] = {res.data, res.len};
+        }
+        if (res.recovered) {
+            uint8_t *const copy = extra(res.recovered, res.recoveredLen);
+            unmask(copy, res.recoveredLen);
+            out[n++] = {copy, res.recoveredLen};
+        }
+        return n;
+    }
+
+    unmask(buf, len);
+    out[0] = {buf - FecHeader::SIZE, len + FecHeader::SIZE};
+    if (!fec->encoder.add(buf, len, options.fecMask, fec->stats)) {
+        return 1;
+    }
+    out[1] = {extra(fec->encoder.parity(), fec->encoder.parityLen()), fec->encoder.parityLen()};
+    return 2;
+}
+
+uint8_t *Forwarder::extra(const uint8_t *data, size_t len) {
+    auto &buf = extras[extrasUsed++ % extras.size()];
+    if (buf.size() < len + sizeof(mask)) { // unmask() works in whole words
+        buf.resize(len + sizeof(mask));
+    }
+    ::memcpy(buf.data(), data, len);
+    return buf.data();
+}
+
+void Forwarder::unmask(uint8_t *buf, size_t len) const {
+    if (mask) {
+        Tools::xor_block(
+            reinterpret_cast<uint64_t *>(buf),
+            (len + sizeof(mask) - 1) / sizeof(mask), // division with rounding up
+            mask
+        );
+    }
+}
+
+FecFlow *Forwarder::fecFlow(int upstream, const struct sockaddr_in6 &client) {
+    if (!options.fec) {
+        return nullptr;
+    }
+    auto &fec = fecFlows[upstream];
+    if (!fec) {
+        fec = std::make_unique<FecFlow>(client, options.fecGroup, options.fecWindow);
+    }
+    return fec.get();
+}
+
+ssize_t Forwarder::forwardRequest(
+    int sock,
+    FecFlow *fec,
+    uint8_t *buf,
+    size_t len,
+    LatencySample *s
+) {
+    struct iovec out[2];
+    const int n = prepare(fec, Direction::Request, buf, len, out);
+    if (n == 0) {
+        return 0;
+    }
+    const ssize_t ret = sendRequest(sock, (uint8_t *)out[0].iov_base, out[0].iov_len, s);
+    // a lost parity or recovered datagram is what FEC is for, the caller only hears of the
+    // datagram it passed in
+    if (n > 1 && sendRequest(sock, (uint8_t *)out[1].iov_base, out[1].iov_len, nullptr) < 0) {
+        ::perror("send");
+    }
+    return ret;
+}
+
+// sends a request datagram, requesting a transmit timestamp if it is sampled
+ssize_t Forwarder::sendRequest(int sock, uint8_t *buf, size_t len, LatencySample *sample) {
+    struct iovec iov = {buf, len};
+    struct msghdr msg;
+    ::memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (sample == nullptr) {
+        return io.send(sock, &msg);
+    }
+
+    tracer->requestTx(msg);
+    sample->send = LatencyTracer::now();
+    const ssize_t ret = io.send(sock, &msg);
+    if (ret >= 0) {
+        tracer->sent(sock, *sample);
+    }
+    return ret;
+}
+
+void Forwarder::sendBatch(int fd, struct mmsghdr *out, int count, uint64_t recvTime) {
+    if (tracer) {
+        for (int i = 0; i < count; i += 1) {
+            if (sampled[i]) {
+                tracer->requestTx(out[i].msg_hdr);
+            }
+        }
+    }
+
+    const uint64_t send_time = tracer ? LatencyTracer::now() : recvTime;
+    const int sent_cnt = io.sendBatch(fd, out, count);
+
+    if (tracer) {
+        for (int i = 0; i < count; i += 1) {
+            if (!sampled[i]) {
+                continue;
+            }
+            sampled[i] = false;
+            out[i].msg_hdr.msg_control = nullptr;
+            out[i].msg_hdr.msg_controllen = 0;
+            samples[i].send = send_time;
+            if (i < sent_cnt) {
+                tracer->sent(fd, samples[i]);
+            }
+        }
+    }
+
+    if (sent_cnt < 0) {
+        ::perror("sendmmsg");
+    }
+}
+
+void Forwarder::sample(
+    int i,
+    struct msghdr &received,
+    size_t len,
+    uint64_t recvTime,
+    Direction dir
+) {
+    sampled[i] = tracer && tracer->shouldSample();
+    if (sampled[i]) {
+        samples[i] = {
+            LatencyTracer::rxTimestamp(received),
+            recvTime,
+            0,
+            0,
+            static_cast<uint32_t>(len),
+            dir
+        };
+    }
+}
+
+void Forwarder::dropUpstream(int sock) {
+    if (tracer) {
+        tracer->forget(sock);
+    }
+    if (options.fastPath) {
+        options.fastPath->remove(sock);
+    }
+    fecFlows.erase(sock);
+    io.closeUpstream(sock);
+}
+
+// the first datagrams of a client arrive on the listen socket, later ones only if they were
+// queued before its connected socket existed
+void Forwarder::sendToFlow(
+    const struct sockaddr_in6 &client,
+    uint8_t *buf,
+    size_t len,
+    LatencySample *s
+) {
+    auto it = connectedFlows.find(client);
+    const bool created = it == connectedFlows.end();
+    if (created) {
+        auto flow = std::make_unique<Flow>();
+        flow->client = {-1, Direction::Request, flow.get()};
+        flow->upstream = {-1, Direction::Response, flow.get()};
+        flow->addr = client;
+        flow->used = true;
+        if (options.fec) {
+            flow->fec = std::make_unique<FecFlow>(client, options.fecGroup, options.fecWindow);
+        }
+
+        flow->upstream.fd = io.openUpstream(&flow->upstream);
+        try {
+            flow->client.fd = io.openClient(client, &flow->client);
+        } catch (...) {
+            io.closeUpstream(flow->upstream.fd);
+            throw;
+        }
+        it = connectedFlows.emplace(client, std::move(flow)).first;
+    }
+
+    Flow &flow = *it->second;
+    flow.used = true;
+    if (forwardRequest(flow.upstream.fd, flow.fec.get(), buf, len, s) < 0) {
+        ::perror("send");
+        if (created) {
+            closeFlow(flow);
+        }
+    }
+}
+
+int Forwarder::closeFlow(Flow &flow) {
+    int ret = 0;
+    for (FlowSide *side : {&flow.client, &flow.upstream}) {
+        if (tracer) {
+            tracer->forget(side->fd);
+        }
+        const int err = side == &flow.client ? io.closeClient(side->fd)
+                                              : io.closeUpstream(side->fd);
+        if (err < 0) {
+            ret = err;
+        }
+        side->fd = -1;
+    }
+
+    auto it = connectedFlows.find(flow.addr);
+    closedFlows.push_back(std::move(it->second));
+    connectedFlows.erase(it);
+    return ret;
+}
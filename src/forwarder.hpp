@@ -0,0 +1,161 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <netinet/in.h>
+#include <ostream>
+#include <sys/socket.h>
+#include <unordered_map>
+#include <vector>
+
+#include "fast_path.hpp"
+#include "fec.hpp"
+#include "io.hpp"
+#include "latency.hpp"
+#include "table.hpp"
+
+struct ForwarderOptions {
+    LatencyTracer *tracer = nullptr;
+
+    // a socket per client connected to it, see Forwarder
+    bool connected = false;
+
+    // FEC on the link towards the destination (or towards the clients without fecToDest)
+    bool fec = false;
+    bool fecToDest = true;
+    unsigned int fecGroup = 4;
+    unsigned int fecWindow = 8;
+    uint64_t fecMask = 0; // mask of the link side, applied to FEC headers
+
+    // established flows forwarded in the kernel, not with connected or FEC
+    FastPath *fastPath = nullptr;
+
+    bool encodes(Direction dir) const {
+        return fec && fecToDest == (dir == Direction::Request);
+    }
+};
+
+// The packet path of the proxy: datagrams from clients arriving on the listen socket are
+// unmasked and sent through a per-client upstream socket, responses go back the same way.
+//
+// In connected mode every client also gets its own socket on the listen address connected
+// to it, so the kernel delivers its datagrams there and no address lookup is needed.
+class Forwarder {
+  public:
+    static constexpr int MAX_MSGS = 32;
+    static constexpr size_t BUFFER_SIZE = 65536;
+    // outgoing batches also carry parity and recovered datagrams, at most one per datagram
+    static constexpr int MAX_OUT = 2 * MAX_MSGS;
+
+    struct Flow;
+
+    // One socket of a connected flow, epoll events of the socket carry a pointer to it.
+    // The descriptor is the first member, so the event loop can read it from the pointer.
+    struct FlowSide {
+        int fd;
+        Direction dir; // of the datagrams received on this socket
+        Flow *flow;
+    };
+
+    struct Flow {
+        FlowSide client;
+        FlowSide upstream;
+        struct sockaddr_in6 addr;
+        bool used;
+        std::unique_ptr<FecFlow> fec;
+    };
+
+    Forwarder(PacketIo &io, int listenFd, uint64_t mask, const ForwarderOptions &options = {});
+
+    Forwarder &operator=(const Forwarder &) = delete;
+    Forwarder &operator=(Forwarder &&) = delete;
+    Forwarder(const Forwarder &) = delete;
+    Forwarder(Forwarder &&) = delete;
+
+    void onListenReadable();
+
+    void onUpstreamReadable(int sock);
+
+    // connected mode: a socket of the flow has datagrams
+    void onFlowReadable(FlowSide *side);
+
+    // closes upstream sockets that were idle since the previous call
+    void onTimer();
+
+    // frees flows closed while handling the last batch of events, their sides may still be
+    // referenced by the events that were not handled yet
+    void reap() {
+        closedFlows.clear();
+    }
+
+    // closes all upstream sockets, returns false if any close() failed
+    bool closeAll();
+
+    size_t flows() const {
+        return table.s2a.size() + connectedFlows.size();
+    }
+
+    // prints the FEC and fast path counters of every flow
+    void dump(std::ostream &out) const;
+
+  private:
+    // unmasks a received datagram and applies FEC, writes the datagrams to forward to out
+    // (up to 2) and returns their number
+    int prepare(FecFlow *fec, Direction dir, uint8_t *buf, size_t len, struct iovec *out);
+
+    // keeps a parity or recovered datagram until the batch is sent
+    uint8_t *extra(const uint8_t *data, size_t len);
+
+    void unmask(uint8_t *buf, size_t len) const;
+
+    FecFlow *fecFlow(int upstream, const struct sockaddr_in6 &client);
+
+    // sends a request with its FEC datagrams, fails only if the request itself wasn't sent
+    ssize_t forwardRequest(int sock, FecFlow *fec, uint8_t *buf, size_t len, LatencySample *s);
+
+    ssize_t sendRequest(int sock, uint8_t *buf, size_t len, LatencySample *sample);
+
+    // sends the datagrams of the batch, finishing their latency samples
+    void sendBatch(int fd, struct mmsghdr *out, int count, uint64_t recvTime);
+
+    // remembers a latency sample for out[i] if this datagram is sampled
+    void sample(int i, struct msghdr &received, size_t len, uint64_t recvTime, Direction dir);
+
+    void dropUpstream(int sock);
+
+    void sendToFlow(const struct sockaddr_in6 &client, uint8_t *buf, size_t len, LatencySample *s);
+
+    int closeFlow(Flow &flow);
+
+    PacketIo &io;
+    const int listenFd;
+    const uint64_t mask;
+    LatencyTracer *const tracer;
+    const bool connected;
+    const ForwarderOptions options;
+
+    AddrTable table;
+
+    unordered_map<struct sockaddr_in6, std::unique_ptr<Flow>> connectedFlows;
+    std::vector<std::unique_ptr<Flow>> closedFlows;
+
+    unordered_map<int, std::unique_ptr<FecFlow>> fecFlows; // by upstream socket
+    std::vector<std::vector<uint8_t>> extras;
+    size_t extrasUsed = 0;
+
+    std::unique_ptr<unsigned char[]> buffers;
+
+    struct mmsghdr msgs[MAX_MSGS];
+    struct mmsghdr msgsNoAddr[MAX_MSGS];
+    struct mmsghdr msgsCommonAddr[MAX_OUT];
+    struct mmsghdr msgsConnected[MAX_OUT];
+    struct iovec iovecsConst[MAX_MSGS];
+    struct iovec iovecsMut[MAX_OUT];
+    struct iovec iovecsConnected[MAX_OUT];
+    struct sockaddr_in6 reqAddrs[MAX_MSGS];
+    struct sockaddr_in6 respCommonAddr;
+
+    alignas(struct cmsghdr) char controls[MAX_MSGS][LatencyTracer::CONTROL_SIZE];
+    LatencySample samples[MAX_OUT];
+    bool sampled[MAX_OUT];
+};
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+// Packet I/O used by the forwarding core. The calls follow recvmmsg()/sendmmsg()/sendmsg():
+// they return the number of messages (or bytes) or -1 with errno set.
+class PacketIo {
+  public:
+    virtual ~PacketIo() = default;
+
+    virtual int recvBatch(int fd, struct mmsghdr *msgs, unsigned int len) = 0;
+
+    virtual int sendBatch(int fd, struct mmsghdr *msgs, unsigned int len) = 0;
+
+    virtual ssize_t send(int fd, const struct msghdr *msg) = 0;
+
+    // a new socket connected to the destination, watched for incoming datagrams; events
+    // carry tag if it is set, the descriptor otherwise
+    virtual int openUpstream(void *tag = nullptr) = 0;
+
+    virtual int closeUpstream(int fd) = 0;
+
+    // a new socket on the listen address connected to the client, events carry tag
+    virtual int openClient(const struct sockaddr_in6 &client, void *tag) = 0;
+
+    virtual int closeClient(int fd) = 0;
+};
@@ -0,0 +1,352 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <deque>
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+#include <netinet/in.h>
+#include <ostream>
+#include <sys/socket.h>
+#include <system_error>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Log-linear histogram in the spirit of HdrHistogram: every power of two is split into
+// SUB_COUNT equal buckets, so the relative error stays below 1 / SUB_COUNT for any value.
+class Histogram {
+  public:
+    static constexpr int SUB_BITS = 5;
+    static constexpr uint64_t SUB_COUNT = 1 << SUB_BITS;
+    static constexpr size_t BUCKETS = (64 - SUB_BITS + 1) * SUB_COUNT;
+
+    void record(uint64_t value) {
+        counts[index(value)] += 1;
+        total += 1;
+        minValue = std::min(minValue, value);
+        maxValue = std::max(maxValue, value);
+    }
+
+    uint64_t count() const {
+        return total;
+    }
+
+    uint64_t min() const {
+        return total ? minValue : 0;
+    }
+
+    uint64_t max() const {
+        return maxValue;
+    }
+
+    // highest value equivalent to the one at the given quantile (0.0 - 1.0)
+    uint64_t percentile(double q) const {
+        if (total == 0) {
+            return 0;
+        }
+        const uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(q * total + 0.5));
+        uint64_t seen = 0;
+        for (size_t i = 0; i < BUCKETS; i++) {
+            seen += counts[i];
+            if (seen >= rank) {
+                return std::min(i + 1 < BUCKETS ? lowest(i + 1) - 1 : UINT64_MAX, maxValue);
+            }
+        }
+        return maxValue;
+    }
+
+  private:
+    static size_t index(uint64_t value) {
+        if (value < SUB_COUNT) {
+            return value;
+        }
+        const int exp = 63 - __builtin_clzll(value);
+        return (exp - SUB_BITS + 1) * SUB_COUNT + ((value >> (exp - SUB_BITS)) & (SUB_COUNT - 1));
+    }
+
+    static uint64_t lowest(size_t idx) {
+        if (idx < SUB_COUNT) {
+            return idx;
+        }
+        const int exp = idx / SUB_COUNT + SUB_BITS - 1;
+        return (SUB_COUNT + idx % SUB_COUNT) << (exp - SUB_BITS);
+    }
+
+    std::array<uint64_t, BUCKETS> counts = {};
+    uint64_t total = 0;
+    uint64_t minValue = UINT64_MAX;
+    uint64_t maxValue = 0;
+};
+
+enum class Direction : uint8_t {
+    Request,  // client -> upstream
+    Response, // upstream -> client
+};
+
+// All timestamps are CLOCK_REALTIME nanoseconds, the clock used by software SO_TIMESTAMPING.
+// A zero timestamp means the kernel did not provide one.
+struct LatencySample {
+    uint64_t rx;   // kernel receive
+    uint64_t recv; // recvmmsg() returned
+    uint64_t send; // right before the send syscall
+    uint64_t tx;   // kernel transmit
+    uint32_t len;
+    Direction dir;
+};
+
+// Single-producer ring of the most recent samples. The reader never blocks the writer:
+// it copies entries and then discards those the writer may have overwritten meanwhile.
+class TraceRing {
+  public:
+    explicit TraceRing(size_t size)
+        : slots(size) {}
+
+    void push(const LatencySample &sample) {
+        if (slots.empty()) {
+            return;
+        }
+        const uint64_t pos = head.load(std::memory_order_relaxed);
+        slots[pos % slots.size()] = sample;
+        head.store(pos + 1, std::memory_order_release);
+    }
+
+    std::vector<LatencySample> snapshot() const {
+        const uint64_t end = head.load(std::memory_order_acquire);
+        const uint64_t begin = end > slots.size() ? end - slots.size() : 0;
+        std::vector<LatencySample> out;
+        out.reserve(end - begin);
+        for (uint64_t pos = begin; pos < end; pos++) {
+            out.push_back(slots[pos % slots.size()]);
+        }
+        const uint64_t now = head.load(std::memory_order_acquire);
+        const uint64_t overwritten = now - end;
+        out.erase(out.begin(), out.begin() + std::min<uint64_t>(overwritten, out.size()));
+        return out;
+    }
+
+  private:
+    std::vector<LatencySample> slots;
+    std::atomic<uint64_t> head = 0;
+};
+
+// Measures how long forwarded datagrams spend inside the proxy using software
+// SO_TIMESTAMPING: the receive timestamp is read from recvmmsg() control data, the transmit
+// timestamp is requested per sampled packet and read back from the socket error queue.
+class LatencyTracer {
+  public:
+    static constexpr size_t CONTROL_SIZE = CMSG_SPACE(sizeof(struct scm_timestamping)) +
+                                           CMSG_SPACE(sizeof(struct sock_extended_err) + 64);
+
+    LatencyTracer(unsigned int sampleRate, size_t ringSize)
+        : rate(sampleRate),
+          countdown(sampleRate),
+          ring(ringSize) {
+        ::memset(txControl, 0, sizeof(txControl));
+        auto *cmsg = reinterpret_cast<struct cmsghdr *>(txControl);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SO_TIMESTAMPING;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(uint32_t));
+        const uint32_t flags = SOF_TIMESTAMPING_TX_SOFTWARE;
+        ::memcpy(CMSG_DATA(cmsg), &flags, sizeof(flags));
+    }
+
+    static void enable(int fd) {
+        // OPT_ID numbers the timestamped datagrams of the socket from 0, so a lost timestamp
+        // can be told apart from a late one
+        const int flags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE |
+                          SOF_TIMESTAMPING_OPT_TSONLY | SOF_TIMESTAMPING_OPT_ID;
+        if (::setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) < 0) {
+            throw std::system_error(errno, std::generic_category(), "setsockopt SO_TIMESTAMPING");
+        }
+    }
+
+    static uint64_t now() {
+        struct timespec ts;
+        ::clock_gettime(CLOCK_REALTIME, &ts);
+        return toNs(ts);
+    }
+
+    static uint64_t rxTimestamp(struct msghdr &msg) {
+        for (auto *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_TIMESTAMPING) {
+                struct scm_timestamping tss;
+                ::memcpy(&tss, CMSG_DATA(cmsg), sizeof(tss));
+                return toNs(tss.ts[0]);
+            }
+        }
+        return 0;
+    }
+
+    bool shouldSample() {
+        if (--countdown != 0) {
+            return false;
+        }
+        countdown = rate;
+        return true;
+    }
+
+    // attach a transmit timestamp request to an outgoing message
+    void requestTx(struct msghdr &msg) const {
+        msg.msg_control = const_cast<char *>(txControl);
+        msg.msg_controllen = CMSG_SPACE(sizeof(uint32_t));
+    }
+
+    // the sample was sent through fd with requestTx(), wait for its transmit timestamp
+    void sent(int fd, const LatencySample &sample) {
+        auto &p = pending[fd];
+        if (p.samples.size() >= MAX_PENDING) {
+            commit(p.samples.front().second);
+            p.samples.pop_front();
+        }
+        p.samples.emplace_back(p.nextKey++, sample);
+    }
+
+    // reads transmit timestamps from the error queue, returns how many were consumed
+    int drainErrQueue(int fd) {
+        int drained = 0;
+        for (;;) {
+            alignas(struct cmsghdr) char control[CONTROL_SIZE];
+            struct msghdr msg;
+            ::memset(&msg, 0, sizeof(msg));
+            msg.msg_control = control;
+            msg.msg_controllen = sizeof(control);
+
+            if (::recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+                break;
+            }
+
+            uint64_t tx = 0;
+            uint32_t key = 0;
+            bool isTxStamp = true;
+            for (auto *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+                if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_TIMESTAMPING) {
+                    struct scm_timestamping tss;
+                    ::memcpy(&tss, CMSG_DATA(cmsg), sizeof(tss));
+                    tx = toNs(tss.ts[0]);
+                } else if ((cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) ||
+                           (cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR)) {
+                    struct sock_extended_err serr;
+                    ::memcpy(&serr, CMSG_DATA(cmsg), sizeof(serr));
+                    isTxStamp = serr.ee_origin == SO_EE_ORIGIN_TIMESTAMPING &&
+                                serr.ee_info == SCM_TSTAMP_SND;
+                    key = serr.ee_data;
+                }
+            }
+            if (!isTxStamp || tx == 0) {
+                continue;
+            }
+
+            drained += 1;
+            auto it = pending.find(fd);
+            if (it == pending.end()) {
+                continue;
+            }
+            // samples sent before this one never got their timestamp, commit them without it
+            auto &samples = it->second.samples;
+            while (!samples.empty() && static_cast<int32_t>(samples.front().first - key) < 0) {
+                commit(samples.front().second);
+                samples.pop_front();
+            }
+            if (samples.empty() || samples.front().first != key) {
+                continue;
+            }
+            auto sample = samples.front().second;
+            samples.pop_front();
+            sample.tx = tx;
+            commit(sample);
+        }
+        return drained;
+    }
+
+    // the socket is about to be closed, its transmit timestamps will never arrive
+    void forget(int fd) {
+        auto it = pending.find(fd);
+        if (it == pending.end()) {
+            return;
+        }
+        for (const auto &[_, sample] : it->second.samples) {
+            commit(sample);
+        }
+        pending.erase(it);
+    }
+
+    void commit(const LatencySample &sample) {
+        auto &h = stats[static_cast<size_t>(sample.dir)];
+        const uint64_t end = sample.tx ? sample.tx : sample.send;
+        if (sample.rx) {
+            h.queue.record(delta(sample.rx, sample.recv));
+            h.total.record(delta(sample.rx, end));
+        }
+        h.loop.record(delta(sample.recv, sample.send));
+        if (sample.tx) {
+            h.tx.record(delta(sample.send, sample.tx));
+        }
+        ring.push(sample);
+    }
+
+    void dump(std::ostream &out) const {
+        static const char *const names[] = {"request", "response"};
+        for (size_t d = 0; d < stats.size(); d++) {
+            out << names[d] << " latency, ns (1/" << rate << " packets sampled)" << std::endl;
+            print(out, "  kernel queue", stats[d].queue);
+            print(out, "  main loop", stats[d].loop);
+            print(out, "  kernel tx", stats[d].tx);
+            print(out, "  total", stats[d].total);
+        }
+
+        const auto trace = ring.snapshot();
+        if (trace.empty()) {
+            return;
+        }
+        out << "trace (dir len rx queue loop tx)" << std::endl;
+        for (const auto &s : trace) {
+            out << "  " << names[static_cast<size_t>(s.dir)] << ' ' << s.len << ' ' << s.rx << ' '
+                << (s.rx ? delta(s.rx, s.recv) : 0) << ' ' << delta(s.recv, s.send) << ' '
+                << (s.tx ? delta(s.send, s.tx) : 0) << std::endl;
+        }
+    }
+
+  private:
+    static constexpr size_t MAX_PENDING = 64;
+
+    // samples of a socket waiting for their transmit timestamps, with their OPT_ID keys
+    struct Pending {
+        uint32_t nextKey = 0;
+        std::deque<std::pair<uint32_t, LatencySample>> samples;
+    };
+
+    struct Stages {
+        Histogram queue; // kernel receive -> recvmmsg() returned
+        Histogram loop;  // recvmmsg() returned -> send syscall
+        Histogram tx;    // send syscall -> kernel transmit
+        Histogram total; // kernel receive -> kernel transmit
+    };
+
+    static uint64_t toNs(const struct timespec &ts) {
+        return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+    }
+
+    static uint64_t delta(uint64_t from, uint64_t to) {
+        return to > from ? to - from : 0;
+    }
+
+    static void print(std::ostream &out, const char *name, const Histogram &h) {
+        out << name << ": count=" << h.count() << " min=" << h.min()
+            << " p50=" << h.percentile(0.5) << " p90=" << h.percentile(0.9)
+            << " p99=" << h.percentile(0.99) << " p99.9=" << h.percentile(0.999)
+            << " max=" << h.max() << std::endl;
+    }
+
+    const unsigned int rate;
+    unsigned int countdown;
+    alignas(struct cmsghdr) char txControl[CMSG_SPACE(sizeof(uint32_t))];
+    std::array<Stages, 2> stats;
+    std::unordered_map<int, Pending> pending;
+    TraceRing ring;
+};
@@ -12,7 +12,8 @@
 #include "tools.hpp"
 
 struct Listener {
-    static int create(const char *port, struct sockaddr_storage *addr) {
+    // with reusePort the address can be shared with sockets created by connect()
+    static int create(const char *port, struct sockaddr_storage *addr, bool reusePort = false) {
         struct addrinfo hints;
         ::memset(&hints, 0, sizeof(hints));
         hints.ai_family = AF_INET6;
@@ -45,6 +46,12 @@ struct Listener {
                 throw std::system_error(errno, std::generic_category(), "setsockopt SO_REUSEADDR");
             }
 
+            if (reusePort &&
+                ::setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes)) < 0) {
+                ::close(sockfd);
+                throw std::system_error(errno, std::generic_category(), "setsockopt SO_REUSEPORT");
+            }
+
             const int no = 0;
             if (::setsockopt(sockfd, IPPROTO_IPV6, IPV6_V6ONLY, &no, sizeof(no)) < 0) {
                 ::close(sockfd);
@@ -58,13 +65,51 @@ struct Listener {
 
             break;
         }
-        ::memcpy(addr, p->ai_addr, p->ai_addrlen);
+        if (p == NULL) {
+            ::freeaddrinfo(res);
+            throw std::system_error(errno, std::generic_category(), "bind");
+        }
         ::freeaddrinfo(res);
 
-        if (p == NULL) {
+        socklen_t addrlen = sizeof(*addr);
+        if (::getsockname(sockfd, reinterpret_cast<struct sockaddr *>(addr), &addrlen) < 0) {
+            ::close(sockfd);
+            throw std::system_error(errno, std::generic_category(), "getsockname");
+        }
+
+        return sockfd;
+    }
+
+    // a socket sharing the address of a reusePort listener that receives only the datagrams
+    // of one client, the kernel prefers connected sockets when delivering
+    static int connect(const struct sockaddr_storage &addr, const struct sockaddr_in6 &client) {
+        int sockfd = ::socket(addr.ss_family, SOCK_DGRAM, 0);
+        if (sockfd == -1) {
+            throw std::system_error(errno, std::generic_category(), "socket");
+        }
+
+        const int yes = 1;
+        if (::setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes)) < 0) {
+            ::close(sockfd);
+            throw std::system_error(errno, std::generic_category(), "setsockopt SO_REUSEPORT");
+        }
+
+        const int no = 0;
+        if (::setsockopt(sockfd, IPPROTO_IPV6, IPV6_V6ONLY, &no, sizeof(no)) < 0) {
+            ::close(sockfd);
+            throw std::system_error(errno, std::generic_category(), "setsockopt IPV6_V6ONLY");
+        }
+
+        if (::bind(sockfd, reinterpret_cast<const struct sockaddr *>(&addr), sizeof(addr)) < 0) {
+            ::close(sockfd);
             throw std::system_error(errno, std::generic_category(), "bind");
         }
 
+        if (::connect(sockfd, reinterpret_cast<const struct sockaddr *>(&client), sizeof(client))) {
+            ::close(sockfd);
+            throw std::system_error(errno, std::generic_category(), "connect");
+        }
+
         return sockfd;
     }
 };
@@ -0,0 +1,226 @@
+#ifndef _GNU_SOURCE
+#  define _GNU_SOURCE
+#endif
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// UDP relay dropping a share of the datagrams in both directions, for testing FEC between
+// two flprox instances
+
+#define MAX_FLOWS 256
+#define BUFFER_SIZE 65536
+
+struct flow {
+    struct sockaddr_in6 client;
+    int sock; // towards the destination
+};
+
+static volatile sig_atomic_t shutdown_flag = false;
+
+static void signal_handler(int signal) {
+    (void)signal;
+    shutdown_flag = true;
+}
+
+static void setup_signal_handlers(void) {
+    struct sigaction sa;
+    sa.sa_handler = signal_handler;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = 0;
+
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGHUP, &sa, NULL);
+}
+
+static int bind_listen(const char *port) {
+    struct addrinfo hints, *res, *p;
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_INET6;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_flags = AI_PASSIVE;
+
+    int rv;
+    if ((rv = getaddrinfo(NULL, port, &hints, &res)) != 0) {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
+        return -1;
+    }
+
+    int sockfd = -1;
+    for (p = res; p != NULL; p = p->ai_next) {
+        if ((sockfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) == -1) {
+            perror("socket");
+            continue;
+        }
+
+        int no = 0;
+        if (setsockopt(sockfd, IPPROTO_IPV6, IPV6_V6ONLY, &no, sizeof(no)) == -1) {
+            perror("setsockopt IPV6_V6ONLY");
+            close(sockfd);
+            sockfd = -1;
+            continue;
+        }
+
+        if (bind(sockfd, p->ai_addr, p->ai_addrlen) == -1) {
+            perror("bind");
+            close(sockfd);
+            sockfd = -1;
+            continue;
+        }
+
+        break;
+    }
+
+    freeaddrinfo(res);
+    return sockfd;
+}
+
+static int connect_dest(const char *host, const char *port) {
+    struct addrinfo hints, *res, *p;
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+
+    int rv;
+    if ((rv = getaddrinfo(host, port, &hints, &res)) != 0) {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
+        return -1;
+    }
+
+    int sockfd = -1;
+    for (p = res; p != NULL; p = p->ai_next) {
+        if ((sockfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) == -1) {
+            continue;
+        }
+        if (connect(sockfd, p->ai_addr, p->ai_addrlen) == -1) {
+            close(sockfd);
+            sockfd = -1;
+            continue;
+        }
+        break;
+    }
+
+    freeaddrinfo(res);
+    return sockfd;
+}
+
+static bool dropped(unsigned int loss_percent, unsigned int *seed) {
+    return (unsigned int)(rand_r(seed) % 100) < loss_percent;
+}
+
+int main(int argc, char **argv) {
+    if (argc != 5 && argc != 6) {
+        fprintf(stderr, "Usage: %s <listen_port> <dest_host> <dest_port> <loss_percent> [seed]\n",
+                argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    const char *dest_host = argv[2];
+    const char *dest_port = argv[3];
+    const unsigned int loss_percent = strtoul(argv[4], NULL, 10);
+    unsigned int seed = argc == 6 ? strtoul(argv[5], NULL, 10) : 1;
+
+    int listen_fd = bind_listen(argv[1]);
+    if (listen_fd < 0) {
+        fprintf(stderr, "Failed to bind\n");
+        exit(EXIT_FAILURE);
+    }
+
+    static struct flow flows[MAX_FLOWS];
+    static struct pollfd fds[MAX_FLOWS + 1];
+    static unsigned char buffer[BUFFER_SIZE];
+    int flow_count = 0;
+    unsigned long relayed = 0, lost = 0;
+
+    fds[0].fd = listen_fd;
+    fds[0].events = POLLIN;
+
+    setup_signal_handlers();
+    printf("UDP lossy relay started on port %s, dropping %u%%\n", argv[1], loss_percent);
+
+    while (!shutdown_flag) {
+        if (poll(fds, flow_count + 1, -1) < 0) {
+            if (errno != EINTR) {
+                perror("poll");
+            }
+            continue;
+        }
+
+        if (fds[0].revents & POLLIN) {
+            struct sockaddr_in6 client;
+            socklen_t client_len = sizeof(client);
+            ssize_t len = recvfrom(listen_fd, buffer, sizeof(buffer), 0,
+                                   (struct sockaddr *)&client, &client_len);
+            if (len < 0) {
+                perror("recvfrom");
+                continue;
+            }
+
+            int i = 0;
+            while (i < flow_count && memcmp(&flows[i].client, &client, sizeof(client)) != 0) {
+                i++;
+            }
+            if (i == flow_count) {
+                if (flow_count == MAX_FLOWS) {
+                    fprintf(stderr, "Too many flows\n");
+                    continue;
+                }
+                flows[i].client = client;
+                flows[i].sock = connect_dest(dest_host, dest_port);
+                if (flows[i].sock < 0) {
+                    fprintf(stderr, "Failed to connect\n");
+                    continue;
+                }
+                fds[i + 1].fd = flows[i].sock;
+                fds[i + 1].events = POLLIN;
+                flow_count++;
+            }
+
+            if (dropped(loss_percent, &seed)) {
+                lost++;
+            } else if (send(flows[i].sock, buffer, len, 0) < 0) {
+                perror("send");
+            } else {
+                relayed++;
+            }
+        }
+
+        for (int i = 0; i < flow_count; i++) {
+            if (!(fds[i + 1].revents & POLLIN)) {
+                continue;
+            }
+            ssize_t len = recv(flows[i].sock, buffer, sizeof(buffer), 0);
+            if (len < 0) {
+                perror("recv");
+                continue;
+            }
+
+            if (dropped(loss_percent, &seed)) {
+                lost++;
+            } else if (sendto(listen_fd, buffer, len, 0, (struct sockaddr *)&flows[i].client,
+                              sizeof(flows[i].client)) < 0) {
+                perror("sendto");
+            } else {
+                relayed++;
+            }
+        }
+    }
+
+    printf("relayed %lu, dropped %lu\n", relayed, lost);
+    for (int i = 0; i < flow_count; i++) {
+        close(flows[i].sock);
+    }
+    close(listen_fd);
+    return 0;
+}
@@ -13,69 +13,68 @@
 #include <sys/uio.h>
 #include <unistd.h>
 
+#include <memory>
 #include <string>
 
 #include "connector.hpp"
 #include "epoll.hpp"
+#include "forwarder.hpp"
+#include "latency.hpp"
 #include "listener.hpp"
-#include "table.hpp"
+#include "socket_io.hpp"
 #include "tools.hpp"
 
 #define MAX_EVENTS 32
-#define MAX_MSGS 32
-#define BUFFER_SIZE 65536
 
 int main(int argc, char **argv) {
     int return_code = EXIT_SUCCESS;
 
-    struct mmsghdr msgs[MAX_MSGS];
-    ::memset(&msgs, 0, sizeof(msgs));
-
-    struct mmsghdr msgs_no_addr[MAX_MSGS];
-    ::memset(&msgs_no_addr, 0, sizeof(msgs));
-
-    struct mmsghdr msgs_common_addr[MAX_MSGS];
-    ::memset(&msgs_common_addr, 0, sizeof(msgs));
-
-    struct iovec iovecs_const[MAX_MSGS];
-    ::memset(&iovecs_const, 0, sizeof(iovecs_const));
-
-    struct iovec iovecs_mut[MAX_MSGS];
-    ::memset(&iovecs_mut, 0, sizeof(iovecs_mut));
-
-    struct sockaddr_in6 req_addrs[MAX_MSGS];
-    ::memset(&req_addrs, 0, sizeof(req_addrs));
-
-    struct sockaddr_in6 resp_common_addr;
-    ::memset(&resp_common_addr, 0, sizeof(resp_common_addr));
-
-    static unsigned char buffers[BUFFER_SIZE][MAX_MSGS];
-
-    for (int i = 0; i < MAX_MSGS; i++) {
-        iovecs_const[i].iov_base = buffers[i];
-        iovecs_const[i].iov_len = BUFFER_SIZE;
-
-        iovecs_mut[i].iov_base = buffers[i];
-        iovecs_mut[i].iov_len = 0;
-
-        msgs[i].msg_hdr.msg_name = &req_addrs[i];
-        msgs[i].msg_hdr.msg_namelen = sizeof(req_addrs[i]);
-        msgs[i].msg_hdr.msg_iov = &iovecs_const[i];
-        msgs[i].msg_hdr.msg_iovlen = 1;
-
-        msgs_no_addr[i].msg_hdr.msg_iov = &iovecs_const[i];
-        msgs_no_addr[i].msg_hdr.msg_iovlen = 1;
-
-        msgs_common_addr[i].msg_hdr.msg_name = &resp_common_addr;
-        msgs_common_addr[i].msg_hdr.msg_namelen = sizeof(resp_common_addr);
-        msgs_common_addr[i].msg_hdr.msg_iov = &iovecs_mut[i];
-        msgs_common_addr[i].msg_hdr.msg_iovlen = 1;
+    unsigned int sample_rate = 0;
+    size_t trace_size = 0;
+    bool connected = false;
+    const char *fec_side = nullptr;
+    unsigned int fec_group = 4;
+    unsigned int fec_window = 8;
+    const char *bpf_ifname = nullptr;
+
+    int opt;
+    while ((opt = ::getopt(argc, argv, "s:r:ce:n:w:b:")) != -1) {
+        switch (opt) {
+        case 'c':
+            connected = true;
+            break;
+        case 'e':
+            fec_side = optarg;
+            break;
+        case 'n':
+            fec_group = std::stoul(optarg);
+            break;
+        case 'w':
+            fec_window = std::stoul(optarg);
+            break;
+        case 'b':
+            bpf_ifname = optarg;
+            break;
+        case 's':
+            sample_rate = std::stoul(optarg);
+            break;
+        case 'r':
+            trace_size = std::stoull(optarg);
+            break;
+        default:
+            Tools::printUsage(argv[0]);
+            return EXIT_FAILURE;
+        }
     }
 
-    if (argc != 7) {
+    if (argc - optind != 6 ||
+        (fec_side && ::strcmp(fec_side, "dest") != 0 && ::strcmp(fec_side, "source") != 0) ||
+        fec_group == 0 || fec_group > FecHeader::MAX_GROUP || fec_window == 0 ||
+        (bpf_ifname && (connected || fec_side))) {
         Tools::printUsage(argv[0]);
         return EXIT_FAILURE;
     }
+    argv += optind - 1;
 
     const char *source_port = argv[1];
     const char *endpoint_name = argv[2];
@@ -89,14 +88,49 @@ int main(int argc, char **argv) {
     Connector cnctr(endpoint_name, endpoint_port);
 
     struct sockaddr_storage bind_addr;
-    int listen_fd = Listener::create(source_port, &bind_addr);
+    int listen_fd = Listener::create(source_port, &bind_addr, connected);
     int timer_fd = Tools::createTimer(connection_timeout);
 
-    AddrTable table;
+    // optional, the proxy forwards everything itself if the kernel refuses the program
+    std::unique_ptr<FastPath> fast_path;
+    if (bpf_ifname) {
+        try {
+            fast_path = std::make_unique<FastPath>(bpf_ifname, bind_addr, mask);
+        } catch (const std::system_error &e) {
+            std::cerr << "eBPF fast path disabled: " << e.what() << std::endl;
+        }
+    }
+
+    std::unique_ptr<LatencyTracer> tracer;
+    if (sample_rate) {
+        tracer = std::make_unique<LatencyTracer>(sample_rate, trace_size);
+        LatencyTracer::enable(listen_fd);
+    }
 
+    // in connected mode events of flow sockets carry Forwarder::FlowSide pointers, so all
+    // events carry a pointer to the descriptor
     Epoll epoll;
-    epoll.add(listen_fd);
-    epoll.add(timer_fd);
+    if (connected) {
+        epoll.add(listen_fd, &listen_fd);
+        epoll.add(timer_fd, &timer_fd);
+    } else {
+        epoll.add(listen_fd);
+        epoll.add(timer_fd);
+    }
+
+    SocketIo io(cnctr, epoll, bind_addr, tracer != nullptr);
+    ForwarderOptions options;
+    options.tracer = tracer.get();
+    options.connected = connected;
+    options.fastPath = fast_path.get();
+    if (fec_side) {
+        options.fec = true;
+        options.fecToDest = ::strcmp(fec_side, "dest") == 0;
+        options.fecGroup = fec_group;
+        options.fecWindow = fec_window;
+        options.fecMask = Tools::u64ToBe(options.fecToDest ? out_mask : in_mask);
+    }
+    Forwarder forwarder(io, listen_fd, mask, options);
 
     struct epoll_event events[MAX_EVENTS];
 
@@ -107,10 +141,23 @@ int main(int argc, char **argv) {
         }
     }
 
+    static sig_atomic_t dumpFlag = 0;
+    if (::signal(SIGUSR1, [](int) { dumpFlag = 1; }) == SIG_ERR) {
+        throw std::system_error(errno, std::generic_category(), "signal");
+    }
+
     std::cout << Tools::showSockaddr(reinterpret_cast<struct sockaddr *>(&bind_addr)) << " -> "
               << Tools::showSockaddr(cnctr.getAddr()) << std::endl;
 
     while (!exitFlag) {
+        if (dumpFlag) {
+            dumpFlag = 0;
+            if (tracer) {
+                tracer->dump(std::cerr);
+            }
+            forwarder.dump(std::cerr);
+        }
+
         int num_events = epoll.wait(events, MAX_EVENTS, -1);
         if (num_events == -1) {
             if (errno == EINTR) {
@@ -122,47 +169,15 @@ int main(int argc, char **argv) {
         }
 
         for (int i = 0; i < num_events; i++) {
-            const int sock = events[i].data.fd;
-            if (sock == listen_fd) {
-                const int msg_count = ::recvmmsg(listen_fd, msgs, MAX_MSGS, MSG_DONTWAIT, NULL);
-                if (msg_count < 0) {
-                    perror("recvmmsg");
-                    continue;
-                }
+            const int sock =
+                connected ? *static_cast<int *>(events[i].data.ptr) : events[i].data.fd;
+            if (tracer && (events[i].events & EPOLLERR) && tracer->drainErrQueue(sock) > 0 &&
+                !(events[i].events & EPOLLIN)) {
+                continue;
+            }
 
-                for (int i = 0; i < msg_count; i += 1) {
-                    uint8_t *const buf = (uint8_t *)msgs[i].msg_hdr.msg_iov->iov_base;
-                    const size_t recv_len = msgs[i].msg_len;
-
-                    if (mask) {
-                        Tools::xor_block(
-                            reinterpret_cast<uint64_t *>(buf),
-                            (recv_len + sizeof(mask) - 1) /
-                                sizeof(mask), // division with rounding up
-                            mask
-                        );
-                    }
-
-                    struct sockaddr_in6 &client_addr =
-                        *reinterpret_cast<struct sockaddr_in6 *>(msgs[i].msg_hdr.msg_name);
-
-                    auto sock = table.find(client_addr);
-                    if (sock != nullptr) {
-                        if (::send(*sock, buf, recv_len, 0) < 0) {
-                            ::perror("send");
-                            continue;
-                        }
-                    } else {
-                        auto sock = cnctr.newConnection();
-                        if (::send(sock, buf, recv_len, 0) < 0) {
-                            ::perror("send");
-                            ::close(sock);
-                            continue;
-                        }
-                        table.add(sock, client_addr);
-                        epoll.add(sock);
-                    }
-                }
+            if (sock == listen_fd) {
+                forwarder.onListenReadable();
             } else if (sock == timer_fd) {
                 uint64_t expirations;
                 if (::read(timer_fd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
@@ -170,47 +185,19 @@ int main(int argc, char **argv) {
                     continue;
                 }
 
-                table.cleanup([&](int sock, const struct sockaddr_in6 &) {
-                    epoll.del(sock);
-                    close(sock);
-                });
+                forwarder.onTimer();
+            } else if (connected) {
+                forwarder.onFlowReadable(static_cast<Forwarder::FlowSide *>(events[i].data.ptr));
             } else {
-                int msg_cnt = ::recvmmsg(sock, msgs_no_addr, MAX_MSGS, MSG_DONTWAIT, NULL);
-                if (msg_cnt < 0) {
-                    ::perror("recvmmsg");
-                    epoll.del(sock);
-                    table.erase(sock);
-                    ::close(sock);
-                    continue;
-                }
-
-                resp_common_addr = *table.find(sock);
-
-                for (int i = 0; i < msg_cnt; i += 1) {
-                    msgs_common_addr[i].msg_hdr.msg_iov->iov_len = msgs_no_addr[i].msg_len;
-                    if (mask) {
-                        Tools::xor_block(
-                            reinterpret_cast<uint64_t *>(iovecs_mut[i].iov_base),
-                            (iovecs_mut[i].iov_len + sizeof(mask) - 1) /
-                                sizeof(mask), // division with rounding up
-                            mask
-                        );
-                    }
-                }
-
-                if (::sendmmsg(listen_fd, msgs_common_addr, msg_cnt, 0) < 0) {
-                    ::perror("sendmmsg");
-                    continue;
-                }
+                forwarder.onUpstreamReadable(sock);
             }
         }
+        forwarder.reap();
     }
 
-    for (const auto &[sock, _] : table.s2a) {
-        if (::close(sock) < 0) {
-            ::perror("close");
-            return_code = EXIT_FAILURE;
-        }
+    forwarder.dump(std::cerr);
+    if (!forwarder.closeAll()) {
+        return_code = EXIT_FAILURE;
     }
 
     if (::close(timer_fd) < 0) {
@@ -223,6 +210,10 @@ int main(int argc, char **argv) {
         return_code = EXIT_FAILURE;
     }
 
+    if (tracer) {
+        tracer->dump(std::cerr);
+    }
+
     std::cout << "Exit" << std::endl;
 
     return return_code;
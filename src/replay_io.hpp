@@ -0,0 +1,354 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <netinet/in.h>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <sys/socket.h>
+#include <system_error>
+#include <vector>
+
+#include "forwarder.hpp"
+#include "io.hpp"
+
+struct ReplayPacket {
+    struct sockaddr_in6 client;
+    size_t offset; // payload position in Trace::data
+    size_t len;
+};
+
+struct Trace {
+    std::vector<ReplayPacket> packets;
+    std::vector<uint8_t> data;
+
+    // clients spread uniformly over `flows` addresses, every payload is the same
+    static Trace synthetic(size_t flows, size_t packetSize, size_t count) {
+        Trace trace;
+        trace.data.resize(packetSize);
+        for (size_t i = 0; i < packetSize; i++) {
+            trace.data[i] = static_cast<uint8_t>(i * 131 + 7);
+        }
+
+        std::mt19937_64 rng(flows * 1000003 + packetSize);
+        std::uniform_int_distribution<size_t> flow(0, flows - 1);
+        trace.packets.reserve(count);
+        for (size_t i = 0; i < count; i++) {
+            trace.packets.push_back({clientAddr(flow(rng)), 0, packetSize});
+        }
+        return trace;
+    }
+
+    // UDP datagrams of a classic libpcap capture, the source address is the client
+    static Trace loadPcap(const char *path) {
+        std::ifstream in(path, std::ios::binary);
+        if (!in) {
+            throw std::system_error(errno, std::generic_category(), path);
+        }
+
+        uint8_t hdr[24];
+        if (!in.read(reinterpret_cast<char *>(hdr), sizeof(hdr))) {
+            throw std::runtime_error(std::string(path) + ": truncated pcap header");
+        }
+
+        bool swapped;
+        const uint32_t magic = load32(hdr, false);
+        if (magic == 0xa1b2c3d4 || magic == 0xa1b23c4d) {
+            swapped = false;
+        } else if (magic == 0xd4c3b2a1 || magic == 0x4d3cb2a1) {
+            swapped = true;
+        } else {
+            throw std::runtime_error(std::string(path) + ": not a pcap file");
+        }
+        const uint32_t linktype = load32(hdr + 20, swapped) & 0xffff;
+
+        Trace trace;
+        std::vector<uint8_t> frame;
+        uint8_t rec[16];
+        while (in.read(reinterpret_cast<char *>(rec), sizeof(rec))) {
+            frame.resize(load32(rec + 8, swapped));
+            if (!in.read(reinterpret_cast<char *>(frame.data()), frame.size())) {
+                break;
+            }
+            trace.addFrame(linktype, frame.data(), frame.size());
+        }
+
+        if (trace.packets.empty()) {
+            throw std::runtime_error(std::string(path) + ": no UDP packets");
+        }
+        return trace;
+    }
+
+  private:
+    static struct sockaddr_in6 clientAddr(size_t n) {
+        struct sockaddr_in6 addr;
+        ::memset(&addr, 0, sizeof(addr));
+        addr.sin6_family = AF_INET6;
+        addr.sin6_port = htons(1024 + n % 60000);
+        addr.sin6_addr.s6_addr[10] = 0xff;
+        addr.sin6_addr.s6_addr[11] = 0xff;
+        addr.sin6_addr.s6_addr[12] = 10;
+        addr.sin6_addr.s6_addr[13] = static_cast<uint8_t>(n / 60000);
+        addr.sin6_addr.s6_addr[14] = static_cast<uint8_t>(n / 60000 >> 8);
+        addr.sin6_addr.s6_addr[15] = 1;
+        return addr;
+    }
+
+    static uint32_t load32(const uint8_t *p, bool swapped) {
+        uint32_t v;
+        ::memcpy(&v, p, sizeof(v));
+        return swapped ? __builtin_bswap32(v) : v;
+    }
+
+    static uint16_t loadBe16(const uint8_t *p) {
+        return static_cast<uint16_t>(p[0] << 8 | p[1]);
+    }
+
+    void addFrame(uint32_t linktype, const uint8_t *p, size_t len) {
+        uint16_t proto;
+        switch (linktype) {
+        case 0: // BSD loopback
+            if (len < 4) {
+                return;
+            }
+            proto = (p[0] == 2 || p[3] == 2) ? 0x0800 : 0x86dd;
+            p += 4, len -= 4;
+            break;
+        case 1: // Ethernet
+            if (len < 14) {
+                return;
+            }
+            proto = loadBe16(p + 12);
+            p += 14, len -= 14;
+            while (proto == 0x8100 && len >= 4) { // VLAN tags
+                proto = loadBe16(p + 2);
+                p += 4, len -= 4;
+            }
+            break;
+        case 101: // raw IP
+            if (len < 1) {
+                return;
+            }
+            proto = (p[0] >> 4) == 4 ? 0x0800 : 0x86dd;
+            break;
+        case 113: // Linux cooked capture
+            if (len < 16) {
+                return;
+            }
+            proto = loadBe16(p + 14);
+            p += 16, len -= 16;
+            break;
+        case 276: // Linux cooked capture v2
+            if (len < 20) {
+                return;
+            }
+            proto = loadBe16(p);
+            p += 20, len -= 20;
+            break;
+        default:
+            throw std::runtime_error("unsupported pcap link type " + std::to_string(linktype));
+        }
+
+        struct sockaddr_in6 client;
+        ::memset(&client, 0, sizeof(client));
+        client.sin6_family = AF_INET6;
+
+        if (proto == 0x0800) {
+            const size_t ihl = len >= 20 ? (p[0] & 0x0f) * 4 : 0;
+            if (ihl < 20 || len < ihl + 8 || p[9] != IPPROTO_UDP) {
+                return;
+            }
+            client.sin6_addr.s6_addr[10] = 0xff;
+            client.sin6_addr.s6_addr[11] = 0xff;
+            ::memcpy(&client.sin6_addr.s6_addr[12], p + 12, 4);
+            p += ihl, len -= ihl;
+        } else if (proto == 0x86dd) {
+            if (len < 40 + 8 || p[6] != IPPROTO_UDP) {
+                return;
+            }
+            ::memcpy(&client.sin6_addr, p + 8, 16);
+            p += 40, len -= 40;
+        } else {
+            return;
+        }
+
+        ::memcpy(&client.sin6_port, p, sizeof(client.sin6_port));
+        const size_t udp_len = loadBe16(p + 4);
+        if (udp_len < 8) {
+            return;
+        }
+        const size_t payload = std::min(udp_len, len) - 8;
+
+        packets.push_back({client, data.size(), payload});
+        data.insert(data.end(), p + 8, p + 8 + payload);
+    }
+};
+
+// PacketIo feeding a trace through the forwarding core in memory. The destination echoes
+// every request, each response is checked to carry the original payload back to its client.
+class ReplayIo : public PacketIo {
+  public:
+    static constexpr int LISTEN_FD = 0;
+
+    explicit ReplayIo(const Trace &trace)
+        : trace(trace) {}
+
+    // forwards the whole trace once and returns the number of datagrams forwarded
+    size_t replay(Forwarder &forwarder) {
+        const size_t before = forwarded;
+        for (cursor = 0; cursor < trace.packets.size();) {
+            forwarder.onListenReadable();
+            for (size_t i = 0; i < readable.size(); i++) {
+                forwarder.onUpstreamReadable(readable[i]);
+            }
+            readable.clear();
+            echoData.clear();
+        }
+        return forwarded - before;
+    }
+
+    size_t errors() const {
+        return mismatches;
+    }
+
+    int recvBatch(int fd, struct mmsghdr *msgs, unsigned int len) override {
+        if (fd == LISTEN_FD) {
+            batchStart = cursor;
+            batchSent = 0;
+            unsigned int n = 0;
+            for (; n < len && cursor < trace.packets.size(); n++, cursor++) {
+                const auto &pkt = trace.packets[cursor];
+                deliver(msgs[n], trace.data.data() + pkt.offset, pkt.len);
+                if (msgs[n].msg_hdr.msg_name) {
+                    ::memcpy(msgs[n].msg_hdr.msg_name, &pkt.client, sizeof(pkt.client));
+                    msgs[n].msg_hdr.msg_namelen = sizeof(pkt.client);
+                }
+            }
+            return n ? static_cast<int>(n) : (errno = EAGAIN, -1);
+        }
+
+        auto &queue = flow(fd).echoes;
+        unsigned int n = 0;
+        for (; n < len && n < queue.size(); n++) {
+            deliver(msgs[n], echoData.data() + queue[n].offset, queue[n].len);
+            delivered[n] = queue[n].packet;
+        }
+        queue.erase(queue.begin(), queue.begin() + n);
+        return n ? static_cast<int>(n) : (errno = EAGAIN, -1);
+    }
+
+    int sendBatch(int fd, struct mmsghdr *msgs, unsigned int len) override {
+        if (fd != LISTEN_FD) {
+            errno = EBADF;
+            return -1;
+        }
+        for (unsigned int i = 0; i < len; i++) {
+            const auto &hdr = msgs[i].msg_hdr;
+            const auto &pkt = trace.packets[delivered[i]];
+            size_t sent_len = 0;
+            for (size_t j = 0; j < hdr.msg_iovlen; j++) {
+                sent_len += hdr.msg_iov[j].iov_len;
+            }
+            if (hdr.msg_iovlen != 1 || sent_len != pkt.len ||
+                ::memcmp(hdr.msg_iov[0].iov_base, trace.data.data() + pkt.offset, pkt.len) != 0 ||
+                hdr.msg_name == nullptr ||
+                ::memcmp(hdr.msg_name, &pkt.client, sizeof(pkt.client)) != 0) {
+                mismatches += 1;
+            }
+            msgs[i].msg_len = sent_len;
+        }
+        forwarded += len;
+        return static_cast<int>(len);
+    }
+
+    ssize_t send(int fd, const struct msghdr *msg) override {
+        auto &f = flow(fd);
+        if (f.echoes.empty()) {
+            readable.push_back(fd);
+        }
+        const size_t offset = echoData.size();
+        size_t len = 0;
+        for (size_t i = 0; i < msg->msg_iovlen; i++) {
+            const auto *base = static_cast<const uint8_t *>(msg->msg_iov[i].iov_base);
+            echoData.insert(echoData.end(), base, base + msg->msg_iov[i].iov_len);
+            len += msg->msg_iov[i].iov_len;
+        }
+        f.echoes.push_back({batchStart + batchSent++, offset, len});
+        forwarded += 1;
+        return static_cast<ssize_t>(len);
+    }
+
+    int openUpstream(void *) override {
+        int fd;
+        if (!freeFds.empty()) {
+            fd = freeFds.back();
+            freeFds.pop_back();
+        } else {
+            fd = static_cast<int>(flows.size()) + LISTEN_FD + 1;
+            flows.emplace_back();
+        }
+        flow(fd).open = true;
+        return fd;
+    }
+
+    int closeUpstream(int fd) override {
+        auto &f = flow(fd);
+        if (!f.open) {
+            errno = EBADF;
+            return -1;
+        }
+        f.open = false;
+        f.echoes.clear();
+        freeFds.push_back(fd);
+        return 0;
+    }
+
+    // the replay models the single listen socket only
+    int openClient(const struct sockaddr_in6 &, void *) override {
+        throw std::system_error(EOPNOTSUPP, std::generic_category(), "replay openClient");
+    }
+
+    int closeClient(int) override {
+        errno = EBADF;
+        return -1;
+    }
+
+  private:
+    struct Echo {
+        size_t packet; // index of the request in the trace
+        size_t offset; // echoed bytes in echoData
+        size_t len;
+    };
+
+    struct Flow {
+        bool open = false;
+        std::vector<Echo> echoes;
+    };
+
+    Flow &flow(int fd) {
+        return flows[fd - LISTEN_FD - 1];
+    }
+
+    void deliver(struct mmsghdr &msg, const uint8_t *data, size_t len) {
+        const size_t copied = std::min(len, msg.msg_hdr.msg_iov[0].iov_len);
+        ::memcpy(msg.msg_hdr.msg_iov[0].iov_base, data, copied);
+        msg.msg_hdr.msg_controllen = 0;
+        msg.msg_len = copied;
+    }
+
+    const Trace &trace;
+    size_t cursor = 0;
+    size_t batchStart = 0; // requests of a receive batch reach send() in order
+    size_t batchSent = 0;
+    size_t forwarded = 0;
+    size_t mismatches = 0;
+    size_t delivered[Forwarder::MAX_MSGS];
+    std::vector<int> readable;
+    std::vector<uint8_t> echoData;
+    std::vector<Flow> flows;
+    std::vector<int> freeFds;
+};
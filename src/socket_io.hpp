@@ -0,0 +1,78 @@
+#pragma once
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "connector.hpp"
+#include "epoll.hpp"
+#include "io.hpp"
+#include "latency.hpp"
+#include "listener.hpp"
+
+// PacketIo over real sockets, upstream sockets are registered in the event loop's epoll.
+class SocketIo : public PacketIo {
+  public:
+    SocketIo(
+        Connector &connector,
+        Epoll &epoll,
+        const struct sockaddr_storage &listenAddr,
+        bool timestamping
+    )
+        : connector(connector),
+          epoll(epoll),
+          listenAddr(listenAddr),
+          timestamping(timestamping) {}
+
+    int recvBatch(int fd, struct mmsghdr *msgs, unsigned int len) override {
+        return ::recvmmsg(fd, msgs, len, MSG_DONTWAIT, NULL);
+    }
+
+    int sendBatch(int fd, struct mmsghdr *msgs, unsigned int len) override {
+        return ::sendmmsg(fd, msgs, len, 0);
+    }
+
+    ssize_t send(int fd, const struct msghdr *msg) override {
+        return ::sendmsg(fd, msg, 0);
+    }
+
+    int openUpstream(void *tag) override {
+        return watch(connector.newConnection(), tag);
+    }
+
+    int closeUpstream(int fd) override {
+        epoll.del(fd);
+        return ::close(fd);
+    }
+
+    int openClient(const struct sockaddr_in6 &client, void *tag) override {
+        return watch(Listener::connect(listenAddr, client), tag);
+    }
+
+    int closeClient(int fd) override {
+        epoll.del(fd);
+        return ::close(fd);
+    }
+
+  private:
+    int watch(int sock, void *tag) {
+        try {
+            if (timestamping) {
+                LatencyTracer::enable(sock);
+            }
+            if (tag) {
+                epoll.add(sock, tag);
+            } else {
+                epoll.add(sock);
+            }
+        } catch (...) {
+            ::close(sock);
+            throw;
+        }
+        return sock;
+    }
+
+    Connector &connector;
+    Epoll &epoll;
+    const struct sockaddr_storage listenAddr;
+    const bool timestamping;
+};
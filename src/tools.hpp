@@ -13,9 +13,21 @@ struct Tools {
     static void printUsage(const char *prog_name) {
         std::cerr
             << "Usage: " << prog_name
+            << " [-c] [-s <sample_rate> [-r <trace_size>]]"
+            << " [-e <source|dest> [-n <group>] [-w <window>]] [-b <ifname>]"
             << " <source_port> <dest_hostname> <dest_port> <conn_timeout> <in_mask> <out_mask>"
             << std::endl
-            << "mask is uint64 number, set to 0 if not required" << std::endl;
+            << "mask is uint64 number, set to 0 if not required" << std::endl
+            << "-c gives every client its own connected socket on the listen port" << std::endl
+            << "-s traces the latency of every <sample_rate>-th packet, SIGUSR1 prints it"
+            << std::endl
+            << "-r keeps the last <trace_size> traced packets for the dump" << std::endl
+            << "-e adds FEC on the link to the paired proxy at the given side" << std::endl
+            << "-n sends a parity datagram after every <group> datagrams (1-64, default 4)"
+            << std::endl
+            << "-w recovers datagrams of the last <window> groups (default 8)" << std::endl
+            << "-b forwards established IPv4 flows with an eBPF program on <ifname>,"
+            << " not with -c or -e" << std::endl;
     }
 
     static uint64_t u64ToBe(uint64_t val) {
@@ -0,0 +1,165 @@
+"""eBPF fast path over loopback and over a veth pair.
+
+On lo: client -> flprox -b lo -> flprox -> echo. The first proxy masks the datagrams and the
+second one unmasks them, so they only come back intact if the program XORs them like the
+proxy does. lo doesn't verify checksums.
+
+On veth, as root: flprox -b runs on one end of a veth pair, the client and flprox -> echo run
+in a network namespace behind the other end. Their datagrams hairpin through the program and
+out of the same interface with redirect_neigh. Checksum offload is off on both ends, so every
+datagram carries a full checksum that the receiving socket verifies. A second client on
+127.0.0.1 has to stay in userspace, rewritten datagrams with its address would be martians.
+
+Run as root the program has to forward most datagrams; run as nobody flprox has to fall back
+to forwarding everything itself. Without root only the fallback is tested, and if the kernel
+refuses the program to root the test is skipped.
+"""
+
+import ctypes
+import fcntl
+import os
+import shutil
+import socket
+import struct
+import subprocess
+import sys
+import tempfile
+
+from proxy_test import Processes, burst, counters, fail, free_ports
+
+MASK = 81985529216486895
+COUNT = 2000
+SKIP = 77
+NOBODY = 65534
+DISABLED = "eBPF fast path disabled"
+
+OUTER_ADDR = "10.199.77.1"
+INNER_ADDR = "10.199.77.2"
+SIOCETHTOOL = 0x8946
+ETHTOOL_SRXCSUM = 0x15
+ETHTOOL_STXCSUM = 0x17
+
+
+def run(bin_dir, **user):
+    """Returns the completed round trips and the output of the flprox with -b."""
+    echo_port, inner_port, outer_port = free_ports(3)
+
+    with Processes(bin_dir) as p:
+        p.start("echo", echo_port)
+        p.start("flprox", inner_port, "127.0.0.1", echo_port, 60, MASK, 0)
+        outer = p.start(
+            "flprox", "-b", "lo", outer_port, "127.0.0.1", inner_port, 60, 0, MASK, **user
+        )
+        p.ready()
+
+        completed = burst(outer_port, COUNT)
+        return completed, p.stop(outer)
+
+
+def ip(*args):
+    subprocess.run(["ip", *args], check=True)
+
+
+def no_csum_offload(dev):
+    """Like ethtool -K dev rx off tx off: full checksums are sent and verified."""
+    with socket.socket(socket.AF_INET, socket.SOCK_DGRAM) as sock:
+        for cmd in (ETHTOOL_SRXCSUM, ETHTOOL_STXCSUM):
+            value = ctypes.create_string_buffer(struct.pack("II", cmd, 0))
+            ifr = struct.pack("16sP", dev.encode(), ctypes.addressof(value)).ljust(40, b"\0")
+            fcntl.ioctl(sock, SIOCETHTOOL, ifr)
+
+
+def burst_in(netns, port, count):
+    """burst() to the outer address from inside netns."""
+    code = f"from proxy_test import burst; print(burst({port}, {count}, host={OUTER_ADDR!r}))"
+    res = subprocess.run(
+        ["ip", "netns", "exec", netns, sys.executable, "-c", code],
+        cwd=os.path.dirname(os.path.abspath(__file__)),
+        capture_output=True,
+        text=True,
+    )
+    if res.returncode != 0:
+        fail(f"client in {netns}: {res.stdout}{res.stderr}")
+    return int(res.stdout)
+
+
+def veth(bin_dir):
+    netns = f"flprox{os.getpid()}"
+    outer_dev, inner_dev = f"fpo{os.getpid()}", f"fpi{os.getpid()}"
+    ip("netns", "add", netns)
+    try:
+        ip("link", "add", outer_dev, "type", "veth", "peer", "name", inner_dev)
+        for dev in (outer_dev, inner_dev):
+            no_csum_offload(dev)
+        ip("link", "set", inner_dev, "netns", netns)
+        ip("addr", "add", f"{OUTER_ADDR}/24", "dev", outer_dev)
+        ip("link", "set", outer_dev, "up")
+        ip("-n", netns, "addr", "add", f"{INNER_ADDR}/24", "dev", inner_dev)
+        ip("-n", netns, "link", "set", inner_dev, "up")
+        ip("-n", netns, "link", "set", "lo", "up")
+
+        echo_port, inner_port, outer_port = free_ports(3)
+        with Processes(bin_dir) as p:
+            p.start("echo", echo_port, netns=netns)
+            p.start("flprox", inner_port, "127.0.0.1", echo_port, 60, MASK, 0, netns=netns)
+            outer = p.start(
+                "flprox", "-b", outer_dev, outer_port, INNER_ADDR, inner_port, 60, 0, MASK
+            )
+            p.ready()
+
+            hairpin = burst_in(netns, outer_port, COUNT)
+            local = burst(outer_port, COUNT, seed=2)
+            out = p.stop(outer)
+    finally:
+        subprocess.run(["ip", "netns", "del", netns])
+
+    print(f"veth: hairpin completed {hairpin}/{COUNT}, local {local}/{COUNT}: {out.strip()}")
+    if hairpin != COUNT:
+        fail(f"only {hairpin} of {COUNT} hairpin round trips completed")
+    if local != COUNT:
+        fail(f"only {local} of {COUNT} round trips from 127.0.0.1 completed")
+    bpf = counters(out, f"bpf {outer_dev}:")
+    if bpf.get("flows") != 1:
+        fail(f"expected only the hairpin flow in the map: {bpf}")
+    if bpf.get("packets", 0) < COUNT:
+        fail(f"the program forwarded only {bpf.get('packets', 0)} datagrams")
+
+
+def main(bin_dir):
+    root = os.geteuid() == 0
+    skip = False
+
+    if root:
+        completed, out = run(bin_dir)
+        print(f"as root: completed {completed}/{COUNT}: {out.strip()}")
+        if DISABLED in out:
+            skip = True
+        else:
+            if completed != COUNT:
+                fail(f"only {completed} of {COUNT} round trips completed")
+            # both directions of all but the first few datagrams
+            packets = counters(out, "bpf lo:").get("packets", 0)
+            if packets < COUNT:
+                fail(f"the program forwarded only {packets} datagrams")
+            veth(bin_dir)
+
+    # nobody has to be able to run the binaries, which the build directory may not allow
+    with tempfile.TemporaryDirectory() as tmp:
+        os.chmod(tmp, 0o755)
+        for name in ("echo", "flprox"):
+            shutil.copy(os.path.join(bin_dir, name), tmp)
+        user = {"user": NOBODY, "group": NOBODY, "extra_groups": []} if root else {}
+        completed, out = run(tmp, **user)
+    print(f"unprivileged: completed {completed}/{COUNT}: {out.strip()}")
+    if DISABLED not in out:
+        fail("no fallback without privileges")
+    if completed != COUNT:
+        fail(f"only {completed} of {COUNT} round trips completed without the fast path")
+
+    if skip:
+        print("SKIP: the kernel refuses the program")
+        sys.exit(SKIP)
+
+
+if __name__ == "__main__":
+    main(sys.argv[1])
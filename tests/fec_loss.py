@@ -0,0 +1,53 @@
+"""Loss injection over loopback: client -> flprox -e dest -> lossy -> flprox -e source -> echo.
+
+With 10% loss each way a round trip completes with probability 0.81 without FEC; the
+parity of the default group of 4 must lift that clearly. Then the -e source proxy restarts
+and its encoder counts groups from 0 again, the flow has to continue through the other one.
+"""
+
+import re
+import sys
+
+from proxy_test import Processes, burst, counters, fail, free_ports
+
+MASK = 81985529216486895
+COUNT = 2000
+RESTART_COUNT = 500
+MIN_COMPLETED = 0.88
+
+
+def main(bin_dir):
+    echo_port, dest_port, lossy_port, src_port, client_port = free_ports(5)
+    dest_args = ("-e", "source", dest_port, "127.0.0.1", echo_port, 60, MASK, 0)
+
+    with Processes(bin_dir) as p:
+        p.start("echo", echo_port)
+        dest = p.start("flprox", *dest_args)
+        lossy = p.start("lossy", lossy_port, "127.0.0.1", dest_port, 10, 7)
+        src = p.start("flprox", "-e", "dest", src_port, "127.0.0.1", lossy_port, 60, 0, MASK)
+        p.ready()
+
+        completed = burst(src_port, COUNT, src_port=client_port)
+        dest_out = p.stop(dest)
+        p.start("flprox", *dest_args)
+        p.ready()
+        restarted = burst(src_port, RESTART_COUNT, seed=2, src_port=client_port)
+
+        fec = counters(p.stop(src) + dest_out, "fec ")
+        lossy_out = p.stop(lossy)
+
+    print(f"completed {completed}/{COUNT}, fec {fec}, lossy: {lossy_out.strip()}")
+    print(f"after the restart completed {restarted}/{RESTART_COUNT}")
+    dropped = re.search(r"dropped (\d+)", lossy_out)
+    if not dropped or int(dropped.group(1)) == 0:
+        fail("lossy dropped nothing")
+    if fec.get("recovered", 0) == 0:
+        fail("no datagram recovered")
+    if completed < MIN_COMPLETED * COUNT:
+        fail(f"only {completed} of {COUNT} round trips completed")
+    if restarted < MIN_COMPLETED * RESTART_COUNT:
+        fail(f"only {restarted} of {RESTART_COUNT} round trips completed after the restart")
+
+
+if __name__ == "__main__":
+    main(sys.argv[1])
@@ -0,0 +1,119 @@
+"""Helpers for the end-to-end tests: running the built binaries on loopback and a UDP client."""
+
+import os
+import random
+import signal
+import socket
+import subprocess
+import sys
+import time
+
+
+def free_ports(count):
+    """Returns UDP ports that were free a moment ago."""
+    socks = []
+    for _ in range(count):
+        s = socket.socket(socket.AF_INET6, socket.SOCK_DGRAM)
+        s.bind(("::", 0))
+        socks.append(s)
+    ports = [s.getsockname()[1] for s in socks]
+    for s in socks:
+        s.close()
+    return ports
+
+
+class Processes:
+    """Starts processes and stops them with SIGINT, collecting their output."""
+
+    def __init__(self, bin_dir):
+        self.bin_dir = bin_dir
+        self.procs = []
+
+    def start(self, name, *args, netns=None, **kwargs):
+        """Runs name from the binary directory, in the network namespace netns if given."""
+        netns_exec = ["ip", "netns", "exec", netns] if netns else []
+        proc = subprocess.Popen(
+            [*netns_exec, os.path.join(self.bin_dir, name), *map(str, args)],
+            stdout=subprocess.PIPE,
+            stderr=subprocess.STDOUT,
+            text=True,
+            **kwargs,
+        )
+        self.procs.append(proc)
+        return proc
+
+    def ready(self):
+        time.sleep(0.5)
+        for proc in self.procs:
+            if proc.poll() is not None:
+                raise RuntimeError(f"{proc.args[0]} exited: {proc.stdout.read()}")
+
+    def stop(self, proc):
+        """Returns everything the process printed."""
+        self.procs.remove(proc)
+        if proc.poll() is None:
+            proc.send_signal(signal.SIGINT)
+        try:
+            out, _ = proc.communicate(timeout=5)
+        except subprocess.TimeoutExpired:
+            proc.kill()
+            out, _ = proc.communicate()
+        return out
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *exc):
+        for proc in list(self.procs):
+            self.stop(proc)
+
+
+def counters(output, prefix):
+    """Sums the name=value counters of the lines starting with prefix."""
+    sums = {}
+    for line in output.splitlines():
+        if not line.startswith(prefix):
+            continue
+        for field in line.split():
+            name, sep, value = field.partition("=")
+            if sep and value.isdigit():
+                sums[name] = sums.get(name, 0) + int(value)
+    return sums
+
+
+def burst(port, count, seed=1, src_port=0, host="127.0.0.1"):
+    """Sends count datagrams of varying sizes to host, returns how many came back intact.
+
+    With src_port the datagrams continue the flow of an earlier burst from the same port.
+    """
+    rng = random.Random(seed)
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 1 << 24)
+    sock.bind(("", src_port))
+    sock.settimeout(1)
+
+    sent = set()
+    for i in range(count):
+        payload = rng.randbytes(1 + (i * 37) % 1400)
+        sent.add(payload)
+        sock.sendto(payload, (host, port))
+        if i % 8 == 7:
+            time.sleep(0.001)
+
+    received = set()
+    try:
+        while len(received) < len(sent):
+            data = sock.recv(65536)
+            if data in sent:
+                received.add(data)
+            else:
+                fail("corrupted datagram received")
+    except socket.timeout:
+        pass
+    sock.close()
+    return len(received)
+
+
+def fail(message):
+    print("FAIL:", message)
+    sys.exit(1)